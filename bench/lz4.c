@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lz4.h"
+
+/* Host benchmark for lib/lz4.c.
+ * Compresses a generated text log and random bytes in 4096 byte clusters,
+ * the size the kernel uses, and reports the ratio and the throughput of
+ * both directions. Every cluster is checked to round trip.
+ * */
+
+#define BUFSZ   (16 << 20)
+#define CLUSTER 4096
+
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+
+/*! Fill `buf` with lines looking like a service log */
+static void gen_log(char *buf, size_t n) {
+    static const char *level[] = { "INFO", "WARN", "DEBUG", "ERROR" };
+    static const char *msg[]   = {
+        "request served", "cache miss, loading from disk",
+        "connection reset by peer", "retrying in 100ms", "worker started",
+    };
+    char   line[160];
+    size_t off = 0;
+    for (unsigned i = 0; off < n; ++i) {
+        int m = snprintf(line, sizeof(line), "2024-03-%02u 12:%02u:%02u.%03u [%s] pid=%u %s id=%u\n",
+                         i / 86400 % 28 + 1, i / 60 % 60, i % 60, rand() % 1000,
+                         level[rand() % 4], 1000 + rand() % 8, msg[rand() % 5], rand());
+        if ((size_t)m > n - off) m = n - off;
+        memcpy(buf + off, line, m);
+        off += m;
+    }
+}
+
+
+static int run(const char *name, const char *buf) {
+    static uint16_t ht[LZ4_HTSIZE];
+    static char     z[BUFSZ / CLUSTER][CLUSTER];
+    static int      zn[BUFSZ / CLUSTER];
+    char            out[CLUSTER];
+    size_t          total  = 0; // bytes stored
+    size_t          zbytes = 0; // bytes of the compressed clusters
+
+    double t = now();
+    for (size_t i = 0; i < BUFSZ / CLUSTER; ++i) {
+        zn[i]  = lz4_compress(buf + i * CLUSTER, CLUSTER, z[i], CLUSTER, ht);
+        total += zn[i] ? zn[i] : CLUSTER;
+    }
+    double tc = now() - t;
+
+    t = now();
+    for (size_t i = 0; i < BUFSZ / CLUSTER; ++i) {
+        if (zn[i] == 0)
+            continue;
+        zbytes += CLUSTER;
+        if (lz4_decompress(z[i], zn[i], out, CLUSTER) != CLUSTER
+            || memcmp(out, buf + i * CLUSTER, CLUSTER) != 0) {
+            fprintf(stderr, "lz4: %s cluster %zu doesn't round trip\n", name, i);
+            return 1;
+        }
+    }
+    double td = now() - t;
+
+    printf("%-6s ratio %5.2f  compress %8.1f MB/s  decompress %8.1f MB/s\n", name,
+           (double)BUFSZ / total, BUFSZ / tc / 1e6, zbytes / td / 1e6);
+    return 0;
+}
+
+
+int main() {
+    char *buf = malloc(BUFSZ);
+    if (!buf) {
+        perror("malloc");
+        return 1;
+    }
+    srand(1);
+
+    gen_log(buf, BUFSZ);
+    if (run("log", buf))
+        return 1;
+
+    for (size_t i = 0; i < BUFSZ; ++i)
+        buf[i] = rand();
+    if (run("random", buf))
+        return 1;
+
+    free(buf);
+    return 0;
+}
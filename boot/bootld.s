@@ -15,6 +15,8 @@ boot1:
 
     call fetch_disk             ; fetch the next sector
 
+    call detect_memory          ; BIOS memory map for the kernel
+
     cli                         ; clean interrupt.
                                 ; enable 32 bit instructions
 
@@ -40,6 +42,39 @@ fetch_disk:
     int 0x13                    ; call disk bios interrupt
     ret
 
+    ; detect_memory : () -> ()
+    ; collect the BIOS E820 memory map at E820_MAP (see i386/e820.h):
+    ; the number of entries, 4 bytes of padding, then 24 bytes entries.
+    ; The BIOS can't be called once we leave real mode.
+E820_MAP equ 0x500              ; same as E820_MAP in mem.h
+E820_MAX equ 32                 ; same as E820_MAX in e820.h
+SMAP     equ 0x534d4150         ; 'SMAP'
+detect_memory:
+    xor ax, ax
+    mov es, ax                  ; es:di points to the next entry
+    mov di, E820_MAP + 8
+    mov dword [E820_MAP], 0
+    xor ebx, ebx                ; continuation, 0 for the first entry
+.next:
+    mov eax, 0xe820
+    mov edx, SMAP
+    mov ecx, 24
+    mov dword [es:di + 20], 1   ; valid if the BIOS only fills 20 bytes
+    int 0x15
+    jc .done                    ; no E820, or past the last entry
+    cmp eax, SMAP
+    jne .done
+    jcxz .skip                  ; empty entry
+    inc dword [E820_MAP]
+    add di, 24
+.skip:
+    test ebx, ebx               ; 0 after the last entry
+    jz .done
+    cmp dword [E820_MAP], E820_MAX
+    jb .next
+.done:
+    ret
+
 enter_protected_mode:
     mov eax, cr0
     or eax, 0x1
@@ -19,13 +19,16 @@
 #define SUPERBLKNO  0
 #define BSIZE       (SECSZ)        // block size
 #define MAXBLKS     1000           // max file system size
+#define MAXINODES   1024           // max number of inodes of a file system
 #define NDEV        32             // max number of devices
-#define NFILE       128            // max number of open files
 #define NINODE      128            // max number of inodes
-#define NOPBLKS     512            // max # of blocks writes
-#define NBUF        (NOPBLKS * 5)  // max buffer size
-#define NLOG        (NOPBLKS * 5)  // max log size
+#define NOPBLKS     16             // max # of blocks writes
+#define NBUF        (NOPBLKS * 32) // max buffer size
+#define NLOG        (NOPBLKS * 3)  // max log size
 #define DIRNAMESZ   32             //  directory name size
+#define NDCACHE     128            // max number of cached directory names
+#define NPCACHE     256            // max number of page cache pages
+#define NPDIRTY     8              // dirty pages an inode keeps before writeback
 #define ROOTDEV     1              // device number of file system root
 
 
@@ -42,5 +45,11 @@
 
 
 /* Process parameters */
+#define NCPU        1  // max number of cpus
 #define NPROC       64 // max number of processes
 #define NOFILE      32 // max number of open files per process
+#define NVMA        16 // max number of file mappings per process
+
+
+/* Memory parameters */
+#define NKCACHE     16 // max number of slab caches
@@ -0,0 +1,22 @@
+#pragma once
+#include <stdint.h>
+
+#define E820_MAX    32 // max number of entries the boot loader collects
+#define E820_RAM    1  // usable memory, the other types are reserved
+
+
+/* An entry of the BIOS memory map (int 0x15, eax = 0xe820) */
+typedef struct E820Entry {
+    uint64_t base;
+    uint64_t len;
+    uint32_t type;
+    uint32_t acpi; // ACPI 3 extended attributes
+} __attribute__((packed)) E820Entry;
+
+
+/* The memory map at E820_MAP, as the boot loader leaves it */
+typedef struct E820Map {
+    uint32_t  n;   // number of entries, 0 if the BIOS has no E820
+    uint32_t  pad;
+    E820Entry e[E820_MAX];
+} __attribute__((packed)) E820Map;
@@ -18,6 +18,11 @@ typedef uint32_t physical_addr;
 #define CR4_PGE	0x00000080  // page Global Enabled
 
 
+/* cpuid 1, edx */
+#define CPUID_PSE 0x00000008  // 4 MiB pages
+#define CPUID_PGE 0x00002000  // global pages
+
+
 /* eflags */
 #define FL_IF   0x00000200  // Interrupt Enable
 
@@ -114,6 +119,20 @@ static inline void io_wait() { outb(0x80, 0); }
 static inline void set_cr3(physical_addr page_dir) { __asm__ volatile("movl %0, %%cr3" : : "r"(page_dir)); }
 
 
+/* Address that caused the last page fault */
+static inline uintptr_t rcr2() {
+    uintptr_t v;
+    __asm__ volatile("movl %%cr2, %0" : "=r"(v));
+    return v;
+}
+
+
+/* Drop the TLB entry of one page */
+static inline void invlpg(const void *va) {
+    __asm__ volatile("invlpg (%0)" : : "r"(va) : "memory");
+}
+
+
 static inline uint32_t get_cr0() {
   uint32_t v;
   __asm__ volatile("mov %%cr0, %0" : "=r"(v));
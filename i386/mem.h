@@ -15,10 +15,10 @@
  *           |                  |                 |                  |
  * DEV_SPACE +------------------+-----> DEV_SPACE +------------------+
  *           |                  |                 |                  |
+ *           |  kmap window     |---> highmem     |  highmem         |
+ * KMAP_BASE +------------------+                 |                  |
  *           |                  |                 |                  |
- *           |                  |                 |                  |
- *           |                  |                 |                  |
- *           +------------------+----->   PHYSTOP +------------------+
+ *           +------------------+----->   phystop +------------------+
  *           |  free memory     |                 |                  |
  *           |                  |                 |                  |
  *       end +------------------+                 |                  |
@@ -29,9 +29,12 @@
  * + EXTMEM  +------------------+----->    EXTMEM +------------------+
  *   (text)  |                  |                 |                  |
  *           |  IO space        |           640k  +------------------+
+ *           |                  |                 |  E820 map        |
  *           |                  |                 |                  |
  * KERN_BASE +------------------+ ---------->   0 +------------------+
+ *           |  file mappings   |
  *           |                  |
+ * MMAP_BASE +------------------+
  *           |                  |
  *           |  program data    |
  *           |     & heap       |
@@ -51,8 +54,15 @@
 /* Max virtual address */
 #define MAXVA     0xFFFFFFFF
 
-/* Top physical memory */
-#define PHYSTOP   0x8000000
+/* Top of the direct map. `phystop` is the top of the memory found in
+ * the E820 map below it, the memory above is highmem */
+#define DIRECTSTOP 0x38000000
+
+/* window for highmem pages, see kmap */
+#define KMAP_BASE (KERN_BASE+DIRECTSTOP)
+
+/* BIOS E820 memory map left by the boot loader */
+#define E820_MAP  0x500
 
 /* peripheral device at high address */
 #define DEV_SPACE 0xFE000000
@@ -60,6 +70,9 @@
 /* separation between ker and user space */
 #define KERN_BASE 0x80000000
 
+/* start of the file mappings, the heap stays below */
+#define MMAP_BASE 0x40000000
+
 /* kernel links here */
 #define KERN_LINK (KERN_BASE+EXTMEM)
 
@@ -73,3 +86,6 @@
 
 /* page size is 4kb */
 #define PAGE_SZ    0x1000
+
+/* large page size (PSE) is 4mb */
+#define LPAGE_SZ   0x400000
@@ -35,10 +35,12 @@ typedef uintptr_t PD; // page directory
 
 
 /* PTE flags */
-#define PTE_P 0x01   // 1 = present in physical memory
-#define PTE_W 0x02   // 1 = read/write, 0 = read only
-#define PTE_U 0x04   // 1 = user, 0 = supervisor only
-#define PTE_D 0x20   // 1 = dirty, 0 has not been written to
+#define PTE_P   0x01   // 1 = present in physical memory
+#define PTE_W   0x02   // 1 = read/write, 0 = read only
+#define PTE_U   0x04   // 1 = user, 0 = supervisor only
+#define PTE_D   0x20   // 1 = dirty, 0 has not been written to
+#define PTE_G   0x100  // 1 = global, kept in the TLB across CR3 loads (PGE)
+#define PTE_COW 0x200  // AVL bit, shared read only until written (copy on write)
 
 
 /* PDE flags are the same as PTE except no dirty bit */
@@ -49,6 +51,13 @@ typedef uintptr_t PD; // page directory
 
 
 
+/* Page fault error code */
+#define FEC_PR 0x01   // 1 = protection violation, 0 = page not present
+#define FEC_WR 0x02   // 1 = caused by a write
+#define FEC_U  0x04   // 1 = caused in user mode
+
+
+
 /* The structure of a 32 bit virtual address:
  * | 10             | 10               |  12     |
  * | Page dir index | page table index |  offset |
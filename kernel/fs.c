@@ -1,14 +1,175 @@
+#include "defs.h"
+#include "err.h"
+#include "string.h"
 #include "block.h"
 #include "fs/file.h"
 #include "fs/bcache.h"
 #include "fs/inode.h"
+#include "fs/dcache.h"
 #include "fs/disk.h"
+#include "fs/log.h"
+#include "fs/dir.h"
+#include "fs/orphan.h"
+#include "fs/pcache.h"
+#include "fs/cleaner.h"
+#include "process/proc.h"
+
+
+extern SuperBlock super_block;
 
 
 void fs_init() {
     ftable_init();
     bcache_init();
     disk_init();
-    block_super(0, 0, true);
+    block_init(ROOTDEV);
+    log_init(ROOTDEV);
+    block_super(ROOTDEV, 0, true); // the replayed log may have updated it
+    cleaner_init(ROOTDEV);
+    block_seg_init(ROOTDEV);
     inode_init();
+    dcache_init();
+    pcache_init();
+    orphan_init(ROOTDEV);
+}
+
+
+/*! Write back all dirty pages and commit the log */
+void fs_sync() {
+    pcache_sync();
+    log_flush();
+}
+
+
+/*! Create the empty file `path`, its directory has to exist. A file
+ *  created by someone else meanwhile is returned as is.
+ *  @return  the referenced inode, 0 if failed.
+ * */
+static Inode *fs_create(char *path) {
+    char   name[DIRNAMESZ];
+    Inode *dir, *ino = 0;
+
+    if ((dir = dir_abspath_parent(path, strlen(path), name)) == 0)
+        return 0;
+
+    log_begin();
+    inode_lock(dir);
+    if (dir->d.type == F_DIR && (ino = dir_lookup(dir, name, 0)) == 0
+        && (ino = inode_allocate(dir->dev, F_FILE, dir->inum)) != 0) {
+        DirEntry e = { .inum = ino->inum };
+        strncpy(e.name, name, DIRNAMESZ);
+        inode_lock(ino);
+        ino->d.nlink = 1;
+        inode_flush(ino);
+        if (!dir_link(dir, e)) { // directory full
+            ino->d.nlink = 0;
+            inode_flush(ino);
+            orphan_add(ino);
+            inode_unlock(ino);
+            inode_drop(ino);
+            ino = 0;
+        } else {
+            inode_unlock(ino);
+        }
+    }
+    inode_unlock(dir);
+    inode_drop(dir);
+    log_end();
+    return ino;
+}
+
+
+/*! Open `path`, with O_CREATE a missing file is created empty. A
+ *  directory can only be opened read only.
+ *  @return  the file, 0 if failed.
+ * */
+File *fs_open(char *path, int flags) {
+    int    mode = flags & O_ACCMODE;
+    Inode *ino;
+    File  *f;
+    bool   dir;
+
+    if ((ino = dir_abspath(path, strlen(path))) == 0 && (flags & O_CREATE))
+        ino = fs_create(path);
+    if (ino == 0)
+        return 0;
+
+    inode_lock(ino);
+    dir = ino->d.type == F_DIR;
+    inode_unlock(ino);
+    if ((dir && mode != O_RDONLY) || (f = file_allocate()) == 0) {
+        inode_drop(ino);
+        return 0;
+    }
+    f->type     = FD_INODE;
+    f->ino      = ino;
+    f->readable = mode != O_WRONLY;
+    f->writable = mode != O_RDONLY;
+    return f;
+}
+
+
+/*! Remove the directory entry of `path`. When the last link is gone the
+ *  file becomes an orphan, its blocks are freed in the background.
+ *  Directories can't be unlinked.
+ *  @return  0 on success, -1 if failed.
+ * */
+int fs_unlink(char *path) {
+    char   name[DIRNAMESZ];
+    Inode *dir, *ino = 0;
+
+    if ((dir = dir_abspath_parent(path, strlen(path), name)) == 0)
+        return -1;
+
+    log_begin();
+    inode_lock(dir);
+    if (dir->d.type == F_DIR && (ino = dir_lookup(dir, name, 0)) != 0) {
+        inode_lock(ino);
+        if (ino->d.type != F_DIR && dir_unlink(dir, name)) {
+            ino->d.nlink--;
+            inode_flush(ino);
+            if (ino->d.nlink == 0)
+                orphan_add(ino);
+        } else {
+            inode_unlock(ino);
+            inode_drop(ino);
+            ino = 0;
+        }
+    }
+    inode_unlock(dir);
+    inode_drop(dir);
+    if (ino) {
+        inode_unlock(ino);
+        inode_drop(ino);
+    }
+    log_end();
+    return ino ? 0 : -1;
+}
+
+
+/*! Get the usage of the root file system. O(1), reads the counters
+ *  kept in the superblock. The compression counters are since boot.
+ * */
+void fs_statfs(StatFs *st) {
+    SuperBlock sb;
+    block_super(ROOTDEV, &sb, false);
+    st->bsize  = BSIZE;
+    st->blocks = sb.ndata;
+    st->bfree  = sb.nfree;
+    st->files  = sb.ninodes;
+    st->ffree  = sb.nifree;
+    pcache_stats(st);
+}
+
+
+/*! Start the file system kernel threads. Needs the ptable. */
+void fs_init2() {
+    if (kthread_create("logd", log_daemon) == 0)
+        panic("fs_init2: logd");
+    if (kthread_create("reaper", orphan_daemon) == 0)
+        panic("fs_init2: reaper");
+    if (kthread_create("flushd", pcache_daemon) == 0)
+        panic("fs_init2: flushd");
+    if ((super_block.flags & SB_LFS) && kthread_create("cleaner", cleaner_daemon) == 0)
+        panic("fs_init2: cleaner");
 }
@@ -1,4 +1,10 @@
 #pragma once
+#include "fs/fdefs.h"
 
 
-void fs_init();
+void  fs_init();
+void  fs_init2();
+void  fs_sync();
+void  fs_statfs(StatFs *st);
+File *fs_open(char *path, int flags);
+int   fs_unlink(char *path);
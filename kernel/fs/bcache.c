@@ -1,4 +1,5 @@
 #include "err.h"
+#include "string.h"
 #include "process/mutex.h"
 #include "process/spinlock.h"
 #include "fs/bcache.h"
@@ -12,6 +13,10 @@
  * We need to ensure there is only one buffer cache node for one particular
  * disk block, otherwise it will causes consistency issues when multiple
  * buffers getting updated and overwrite each other.
+ *
+ * File data is cached by the page cache (pcache.c), the bcache only
+ * carries it to and from the disk: `bcache_forget` releases such a node
+ * and invalidates it, so file data is never cached twice.
  * */
 
 
@@ -65,21 +70,26 @@ static BNode* bcachce_lookup(unsigned dev, blockno_t blockno) {
 }
 
 
-/*! Allocate an unused bcache node for the block. If no block is
- *  available return 0;
+/*! Take an unused node for the block */
+static BNode *bcache_take(BNode *b, unsigned dev, blockno_t blockno) {
+    b->nref    = 1;
+    b->dev     = dev;
+    b->blockno = blockno;
+    b->dirty   = 0;
+    b->valid   = 0;
+    return b;
+}
+
+
+/*! Allocate an unused bcache node for the block.
+ *  If no block is available return 0;
  * */
 static BNode *bcache_allocate(unsigned dev, blockno_t blockno) {
     BNode *b = bcache.head;
 
     do {
-        if (b->nref == 0 && !b->dirty) {
-            b->nref    = 1;
-            b->dev     = dev;
-            b->blockno = blockno;
-            b->dirty   = 0;
-            b->valid   = 0;
-            return b;
-        }
+        if (b->nref == 0 && !b->dirty)
+            return bcache_take(b, dev, blockno);
         b = b->next;
     } while (b != bcache.head);
 
@@ -121,6 +131,36 @@ BNode *bcache_read(devno_t dev, blockno_t blockno, bool poll) {
 }
 
 
+/*! Read `n` blocks at once: the reads of the blocks not cached are all
+ *  queued before waiting. Every node in `out` needs to be released.
+ * */
+void bcache_read_batch(devno_t dev, const blockno_t *blocknos, unsigned n, BNode **out) {
+    for (unsigned i = 0; i < n; ++i) {
+        if ((out[i] = bcache_acquire(dev, blocknos[i])) == 0)
+            panic("bcache read");
+        if (!out[i]->valid)
+            disk_submit(out[i]);
+    }
+    for (unsigned i = 0; i < n; ++i)
+        disk_wait(out[i]);
+}
+
+
+/*! Get a zeroed `BNode` for blockno without reading the disk. For
+ *  blocks whose disk content doesn't matter, like unwritten blocks.
+ * */
+BNode *bcache_get(devno_t dev, blockno_t blockno) {
+    BNode *b;
+    if ((b = bcache_acquire(dev, blockno)) == 0) {
+        panic("bcache get");
+    }
+
+    memset(b->cache, 0, BSIZE);
+    b->valid = true;
+    return b;
+}
+
+
 /*! Write `BNode` to blockno */
 void bcache_write(BNode *b, bool poll) {
     b->dirty = true;
@@ -128,6 +168,43 @@ void bcache_write(BNode *b, bool poll) {
 }
 
 
+/*! Release a node that carried file data for the page cache. The node
+ *  is invalidated unless someone else uses it.
+ * */
+void bcache_forget(BNode *b) {
+    if (b->nref == 1 && !b->dirty)
+        b->valid = false;
+    bcache_release(b);
+}
+
+
+/*! Write a batch of nodes holding file data, sorted by block number and
+ *  queued at once, then forget them.
+ * */
+void bcache_write_batch(BNode **bs, unsigned n) {
+    for (unsigned i = 0; i < n; ++i)
+        bs[i]->dirty = true;
+    disk_sync_batch(bs, n);
+    for (unsigned i = 0; i < n; ++i)
+        bcache_forget(bs[i]);
+}
+
+
+/*! Start writing `BNode` to blockno without waiting for the disk.
+ *  Call `bcache_wait` before releasing the node.
+ * */
+void bcache_write_async(BNode *b) {
+    b->dirty = true;
+    disk_submit(b);
+}
+
+
+/*! Wait for the write started by `bcache_write_async` */
+void bcache_wait(BNode *b) {
+    disk_wait(b);
+}
+
+
 /*! Clean up the node and move it to the head of the cache.
  * */
 static void bcache_free(BNode *b) {
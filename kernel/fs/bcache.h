@@ -4,5 +4,11 @@
 
 void   bcache_init();
 BNode *bcache_read(devno_t dev, blockno_t blockno, bool poll);
+BNode *bcache_get(devno_t dev, blockno_t blockno);
+void   bcache_read_batch(devno_t dev, const blockno_t *blocknos, unsigned n, BNode **out);
 void   bcache_write(BNode *, bool poll);
+void   bcache_write_async(BNode *b);
+void   bcache_write_batch(BNode **bs, unsigned n);
+void   bcache_forget(BNode *b);
+void   bcache_wait(BNode *b);
 BNode *bcache_release(BNode *b);
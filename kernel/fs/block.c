@@ -5,27 +5,83 @@
 #include "fs/fdefs.h"
 #include "fs/block.h"
 #include "fs/bcache.h"
+#include "fs/log.h"
+#include "fs/cleaner.h"
+#include "process/spinlock.h"
+#include "driver/vga.h"
 
 /* Block allocation
  *
  * On disk block structures:
- * [ super | log | inode .. | freemap .. | data .. ]
+ * [ super | log | inode .. | imap .. | freemap .. | refcnt .. | data .. ]
+ *
+ * Freemap updates are metadata, they go through the log and need to
+ * happen inside a transaction.
+ *
+ * The superblock keeps the number of free blocks and free inodes. They
+ * are updated with every allocation and logged with the freemap, so
+ * `statfs` never scans a bitmap. With a single CPU the counters are
+ * updated in place, SMP will need per CPU deltas folded in at commit.
+ *
+ * Log-structured allocation (SB_LFS, `mkfs -l`): the data region is cut
+ * in segments of SEGBLKS blocks. Blocks are handed out in order from the
+ * head segment, and when it's full the head moves to a clean segment,
+ * one without any used block. The page cache (pcache.c) moves every
+ * dirty file block to a new place when it's written back, so the writes
+ * of a random update pattern land one after another in the head
+ * segment. The cleaner (cleaner.c) keeps clean segments available by
+ * moving the live blocks out of mostly empty segments.
  * */
 
 
 #define BITS_PER_BLK (BSIZE * 8) // number of bmap bits per block
+#define NLFSSEGS     (MAXBLKS / SEGBLKS + 1)
+#define CLEANLOW     2 // kick the cleaner below this many clean segments
+
+
+typedef struct Segs {
+    SpinLock       lk;
+    unsigned       nsegs;
+    unsigned       head;           // segment being filled
+    unsigned       cursor;         // next block of the head, from datastart
+    unsigned       nclean;         // number of segments without used block
+    unsigned short live[NLFSSEGS]; // used blocks of each segment
+} Segs;
+
+
+/* Frees inside a transaction
+ *
+ * A block freed by a transaction can't be reused before the transaction
+ * commits. Until then a crash brings back the pointers to it, and data
+ * written in place to the new owner would show up in the old file.
+ * Freed blocks wait on `pending` with their freemap bit still set, so no
+ * allocation can pick them. The log calls `block_free_pending` when it
+ * commits: the bits are cleared as the last updates of the committing
+ * transaction, and nothing allocates before the commit is on the disk.
+ * Without a log there is no transaction, blocks are freed right away.
+ * */
+typedef struct Pending {
+    SpinLock  lk;
+    devno_t   dev;
+    unsigned  n;
+    blockno_t blocks[MAXBLKS];
+} Pending;
+
+
 SuperBlock super_block;
+Segs       segs;
+Pending    pending;
 
 
 void block_init(devno_t dev) {
+    pending.lk = new_lock("pending.lk");
     block_super(dev, &super_block, true);
 }
 
 
-/*! Zero a disk block */
+/*! Zero a disk block, the old content is not read */
 void block_zero(devno_t dev, blockno_t blockno) {
-    BNode *b = bcache_read(dev, blockno, false);
-    memset(b->cache, 0, BSIZE);
+    BNode *b = bcache_get(dev, blockno);
     bcache_write(b, false);
     bcache_release(b);
 }
@@ -50,6 +106,17 @@ void block_super(devno_t dev, SuperBlock *sb, bool update) {
 }
 
 
+/*! Write the in memory superblock through the log. Needs to run inside
+ *  a transaction. Updates within a transaction are absorbed by the log.
+ * */
+void block_super_sync(devno_t dev) {
+    BNode *b = bcache_read(dev, SUPERBLKNO, false);
+    memmove(b->cache, &super_block, sizeof(SuperBlock));
+    log_write(b);
+    bcache_release(b);
+}
+
+
 /*! Freemap bit address.
  *  The freemap stores blocks of bits to indicate whether a data block is in use.
  *  the nth bit from super_block.bmapstart indicates the availability of
@@ -95,6 +162,21 @@ static bool freemap_check(devno_t dev, blockno_t blockno) {
 }
 
 
+/*! Update the live count of the segment of `blockno` */
+static void seg_account(blockno_t blockno, bool used) {
+    if (!(super_block.flags & SB_LFS))
+        return;
+
+    unsigned seg = (blockno - super_block.datastart) / SEGBLKS;
+    lock(&segs.lk);
+    if (used && segs.live[seg]++ == 0)
+        segs.nclean--;
+    if (!used && --segs.live[seg] == 0)
+        segs.nclean++;
+    unlock(&segs.lk);
+}
+
+
 /*! Set freemap bit */
 static void freemap_set(devno_t dev, blockno_t blockno, bool used) {
     if (blockno < super_block.datastart) {
@@ -108,33 +190,31 @@ static void freemap_set(devno_t dev, blockno_t blockno, bool used) {
     } else {
         *byte &= ~(0x80 >> (addr.nbit % 8));
     }
-    bcache_write(b, false);
+    log_write(b);
     bcache_release(b);
+    seg_account(blockno, used);
 }
 
 
 /*! Search for the first free block in the freemap */
-static unsigned freemap_search(devno_t dev, blockno_t *out) {
+static bool freemap_search(devno_t dev, blockno_t *out) {
     unsigned nblks = super_block.datastart - super_block.bmapstart;
     for (unsigned off = 0; off < nblks; ++off) {
         BNode *b = bcache_read(dev, off + super_block.bmapstart, false);
         for (unsigned i = 0; i < sizeof(b->cache); ++i) {
             unsigned char byte = b->cache[i];
 
-            if (byte == 0) {
-                *out = super_block.datastart + off * BITS_PER_BLK;
-                bcache_release(b);
-                return true;
-            }
+            if (byte == 0xff) // all used
+                continue;
 
-            if (byte & 0xff) { // has 1
-                unsigned n = 0;
-                for (; byte & (1 << 7); byte <<= 1, ++n);
-                blockno_t fbno = super_block.datastart + off * BITS_PER_BLK + n;
-                *out = fbno;
-                bcache_release(b);
-                return true;
-            }
+            unsigned n = 0;
+            for (; byte & (0x80 >> n); ++n);
+            blockno_t fbno = super_block.datastart + off * BITS_PER_BLK + i * 8 + n;
+            bcache_release(b);
+            if (fbno >= super_block.nblocks)
+                return false;
+            *out = fbno;
+            return true;
         }
         bcache_release(b);
     }
@@ -142,6 +222,172 @@ static unsigned freemap_search(devno_t dev, blockno_t *out) {
 }
 
 
+/* Segments */
+
+
+/*! First and past the last block of a segment */
+static blockno_t seg_start(unsigned seg) {
+    return super_block.datastart + seg * SEGBLKS;
+}
+
+static blockno_t seg_end(unsigned seg) {
+    blockno_t end = seg_start(seg) + SEGBLKS;
+    return end < super_block.nblocks ? end : super_block.nblocks;
+}
+
+
+/*! Count the used blocks of every segment and open the head in a clean
+ *  one. Runs at mount, after the log is replayed.
+ * */
+void block_seg_init(devno_t dev) {
+    if (!(super_block.flags & SB_LFS))
+        return;
+
+    segs.lk     = new_lock("segs.lk");
+    segs.nsegs  = (super_block.nblocks - super_block.datastart + SEGBLKS - 1) / SEGBLKS;
+    segs.nclean = 0;
+    if (segs.nsegs > NLFSSEGS)
+        panic("block_seg_init: too many segments");
+
+    for (unsigned seg = 0; seg < segs.nsegs; ++seg) {
+        segs.live[seg] = 0;
+        for (blockno_t b = seg_start(seg); b < seg_end(seg); ++b)
+            segs.live[seg] += freemap_check(dev, b);
+        if (segs.live[seg] == 0)
+            segs.nclean++;
+    }
+
+    segs.head = 0;
+    for (unsigned seg = 0; seg < segs.nsegs; ++seg) {
+        if (segs.live[seg] < segs.live[segs.head])
+            segs.head = seg;
+    }
+    segs.cursor = segs.head * SEGBLKS;
+    vga_printf("[\033[32mboot\033[0m] lfs: %d segments, %d clean\n", segs.nsegs, segs.nclean);
+}
+
+
+/*! Move the head to the next clean segment. Called with segs.lk held.
+ *  Return false if there is none.
+ * */
+static bool seg_advance() {
+    for (unsigned i = 1; i < segs.nsegs; ++i) {
+        unsigned seg = (segs.head + i) % segs.nsegs;
+        if (segs.live[seg] == 0) {
+            segs.head   = seg;
+            segs.cursor = seg * SEGBLKS;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/*! Find the next free block at the head. The head moves to a clean
+ *  segment when it's full. Without clean segment any free block is
+ *  used, the cleaner is kicked to make some. Doesn't reserve the block.
+ *  segs.lk isn't held while the freemap is read.
+ * */
+static bool seg_search(devno_t dev, blockno_t *out) {
+    bool found = false, more = true, low;
+
+    lock(&segs.lk);
+    unsigned  head = segs.head;
+    blockno_t b    = super_block.datastart + segs.cursor;
+    unlock(&segs.lk);
+
+    while (!found && more) {
+        for (; b < seg_end(head); ++b) {
+            if (!freemap_check(dev, b)) {
+                found = true;
+                break;
+            }
+        }
+
+        lock(&segs.lk);
+        if (found && segs.head == head) {
+            segs.cursor = b - super_block.datastart;
+        } else if (!found) {
+            if (segs.head == head) // else another allocation moved it
+                more = seg_advance();
+            head = segs.head;
+            b    = super_block.datastart + segs.cursor;
+        }
+        unlock(&segs.lk);
+    }
+
+    lock(&segs.lk);
+    low = segs.nclean < CLEANLOW;
+    unlock(&segs.lk);
+    if (low)
+        cleaner_kick();
+
+    if (found) {
+        *out = b;
+        return true;
+    }
+    return freemap_search(dev, out);
+}
+
+
+/*! `block_alloc_range` of SB_LFS: the run starts at the head and stops
+ *  at the first used block or at the end of the segment.
+ * */
+static unsigned seg_alloc_range(devno_t dev, unsigned want, blockno_t *start) {
+    unsigned n = 0;
+
+    if (want == 0 || !seg_search(dev, start))
+        return 0;
+    for (; n < want && *start + n < super_block.nblocks; ++n) {
+        if (n > 0 && (*start + n - super_block.datastart) % SEGBLKS == 0)
+            break; // next segment
+        if (freemap_check(dev, *start + n))
+            break;
+        freemap_set(dev, *start + n, true);
+    }
+
+    super_block.nfree -= n;
+    block_super_sync(dev);
+    return n;
+}
+
+
+/*! Number of segments without used block, 0 if not SB_LFS */
+unsigned block_seg_clean() {
+    return super_block.flags & SB_LFS ? segs.nclean : 0;
+}
+
+
+/*! Pick the segment to clean: the one with the fewest used blocks, not
+ *  the head, not clean and at most 3/4 used.
+ *  @start, @end  output, the block range of the segment.
+ *  @return  false if no segment is worth cleaning.
+ * */
+bool block_seg_victim(blockno_t *start, blockno_t *end) {
+    int victim = -1;
+
+    if (!(super_block.flags & SB_LFS))
+        return false;
+
+    lock(&segs.lk);
+    for (unsigned seg = 0; seg < segs.nsegs; ++seg) {
+        if (seg == segs.head || segs.live[seg] == 0)
+            continue;
+        if (segs.live[seg] > (seg_end(seg) - seg_start(seg)) * 3 / 4)
+            continue;
+        if (victim < 0 || segs.live[seg] < segs.live[victim])
+            victim = seg;
+    }
+    unlock(&segs.lk);
+
+    if (victim < 0)
+        return false;
+    *start = seg_start(victim);
+    *end   = seg_end(victim);
+    return true;
+}
+
+
 /*! Allocate a zeroed disk block
  *  This will look for the first free block from the freemap.
  *
@@ -150,10 +396,13 @@ static unsigned freemap_search(devno_t dev, blockno_t *out) {
 blockno_t block_alloc(devno_t dev) {
     blockno_t fbno;
 
-    if (freemap_search(dev, &fbno)) {
+    if (super_block.flags & SB_LFS ? seg_search(dev, &fbno) : freemap_search(dev, &fbno)) {
         if (!fbno)
             panic("bad_alloc");
         freemap_set(dev, fbno, true);
+        super_block.nfree--;
+        block_super_sync(dev);
+        block_zero(dev, fbno);
         return fbno;
     }
 
@@ -161,11 +410,213 @@ blockno_t block_alloc(devno_t dev) {
 }
 
 
-/*! Free a block */
+/*! Allocate up to `want` contiguous blocks in one freemap pass. The
+ *  blocks are not zeroed. Needs to run inside a transaction.
+ *  @start   output, the first block of the run.
+ *  @return  length of the run: the first run of `want` free blocks, or
+ *           the longest run if there is none that long. 0 if the disk
+ *           is full.
+ * */
+unsigned block_alloc_range(devno_t dev, unsigned want, blockno_t *start) {
+    if (super_block.flags & SB_LFS)
+        return seg_alloc_range(dev, want, start);
+
+    unsigned nbits = super_block.nblocks - super_block.datastart;
+    unsigned best  = 0, bstart = 0;
+    unsigned run   = 0, rstart = 0;
+    BNode   *b     = 0;
+
+    for (unsigned off = 0; off < nbits && best < want; ++off) {
+        unsigned nbit = off % BITS_PER_BLK;
+        if (nbit == 0) {
+            if (b) bcache_release(b);
+            b = bcache_read(dev, super_block.bmapstart + off / BITS_PER_BLK, false);
+        }
+
+        if (((unsigned char *)b->cache)[nbit / 8] & (0x80 >> (nbit % 8))) {
+            run = 0;
+            continue;
+        }
+        if (run++ == 0)
+            rstart = off;
+        if (run > best) {
+            best   = run;
+            bstart = rstart;
+        }
+    }
+    if (b) bcache_release(b);
+
+    if (best == 0)
+        return 0;
+
+    *start = super_block.datastart + bstart;
+    for (unsigned i = 0; i < best; ++i)
+        freemap_set(dev, *start + i, true);
+    super_block.nfree -= best;
+    block_super_sync(dev);
+    return best;
+}
+
+
+/* Block reference counts
+ *
+ * Cloned files share data blocks. The refcnt region keeps one byte per
+ * data block from `super_block.refstart`: the number of owners besides
+ * the first. Freeing a shared block only drops a reference, the freemap
+ * bit is cleared when the last owner frees it. Writing to a shared
+ * block copies it first, see `inode_write`.
+ * */
+
+
+/*! Get the refcnt block and the byte offset for `blockno` */
+static blockno_t refcnt_addr(blockno_t blockno, unsigned *nth) {
+    if (blockno < super_block.datastart || blockno >= super_block.nblocks)
+        panic("refcnt_addr: not a data block");
+    unsigned off = blockno - super_block.datastart;
+    *nth         = off % BSIZE;
+    return super_block.refstart + off / BSIZE;
+}
+
+
+/*! Number of owners of `blockno` besides the first */
+unsigned block_refcnt(devno_t dev, blockno_t blockno) {
+    unsigned nth;
+    BNode   *b   = bcache_read(dev, refcnt_addr(blockno, &nth), false);
+    unsigned cnt = ((unsigned char *)b->cache)[nth];
+    bcache_release(b);
+    return cnt;
+}
+
+
+/*! Add an owner to `blockno`. Needs to run inside a transaction.
+ *  Return false if the count is saturated.
+ * */
+bool block_ref(devno_t dev, blockno_t blockno) {
+    unsigned       nth;
+    BNode         *b   = bcache_read(dev, refcnt_addr(blockno, &nth), false);
+    unsigned char *cnt = &((unsigned char *)b->cache)[nth];
+    bool           ok  = *cnt < 0xff;
+    if (ok) {
+        (*cnt)++;
+        log_write(b);
+    }
+    bcache_release(b);
+    return ok;
+}
+
+
+/*! Drop an owner of `blockno`. Return true if the block is still used. */
+static bool block_unref(devno_t dev, blockno_t blockno) {
+    unsigned       nth;
+    BNode         *b    = bcache_read(dev, refcnt_addr(blockno, &nth), false);
+    unsigned char *cnt  = &((unsigned char *)b->cache)[nth];
+    bool           used = *cnt > 0;
+    if (used) {
+        (*cnt)--;
+        log_write(b);
+    }
+    bcache_release(b);
+    return used;
+}
+
+
+/*! Clear the freemap bits of `n` blocks. The blocks are sorted, so the
+ *  bits that share a freemap block are cleared with a single read and
+ *  log write.
+ * */
+static void freemap_clear(devno_t dev, blockno_t *blocks, unsigned n) {
+    for (unsigned i = 1; i < n; ++i) { // insertion sort, mostly sorted
+        blockno_t bno = blocks[i];
+        unsigned  j   = i;
+        for (; j > 0 && blocks[j - 1] > bno; --j)
+            blocks[j] = blocks[j - 1];
+        blocks[j] = bno;
+    }
+
+    BNode *b = 0;
+    for (unsigned i = 0; i < n; ++i) {
+        FreemapAddr addr = freemap_addr(blocks[i]);
+        if (!b || b->blockno != addr.bno) {
+            if (b) {
+                log_write(b);
+                bcache_release(b);
+            }
+            b = bcache_read(dev, addr.bno, false);
+        }
+
+        unsigned char *byte = &((unsigned char *)b->cache)[addr.nbit / 8];
+        unsigned char  mask = 0x80 >> (addr.nbit % 8);
+        if (!(*byte & mask))
+            panic("freemap_clear: block is already free");
+        *byte &= ~mask;
+        seg_account(blocks[i], false);
+    }
+
+    if (b) {
+        log_write(b);
+        bcache_release(b);
+    }
+    super_block.nfree += n;
+    block_super_sync(dev);
+}
+
+
+/*! Put `n` blocks on `pending`, or free them now without a log */
+static void free_later(devno_t dev, blockno_t *blocks, unsigned n) {
+    if (super_block.nlog == 0) {
+        freemap_clear(dev, blocks, n);
+        return;
+    }
+
+    lock(&pending.lk);
+    for (unsigned i = 0; i < n; ++i) {
+        for (unsigned j = 0; j < pending.n; ++j) {
+            if (pending.blocks[j] == blocks[i])
+                panic("free_later: block is already free");
+        }
+        if (pending.n == MAXBLKS)
+            panic("free_later: too many blocks");
+        pending.blocks[pending.n++] = blocks[i];
+    }
+    pending.dev = dev;
+    unlock(&pending.lk);
+}
+
+
+/*! Release the blocks freed by the committing transaction. Called by
+ *  the log at commit, the freemap updates go in that transaction.
+ * */
+void block_free_pending() {
+    if (pending.n == 0)
+        return;
+    freemap_clear(pending.dev, pending.blocks, pending.n);
+    pending.n = 0;
+}
+
+
+/*! Free a block, or drop a reference if the block is shared. Needs to
+ *  run inside a transaction, the block is reusable once it commits.
+ * */
 void block_free(devno_t dev, blockno_t blockno) {
     if (!freemap_check(dev, blockno)) {
         panic("block_free: block is already free");
         return;
     }
-    freemap_set(dev, blockno, false);
+    if (block_unref(dev, blockno))
+        return;
+    free_later(dev, &blockno, 1);
+}
+
+
+/*! Free `n` blocks in one go, shared blocks only lose a reference.
+ *  Needs to run inside a transaction.
+ * */
+void block_free_batch(devno_t dev, blockno_t *blocks, unsigned n) {
+    unsigned k = 0;
+    for (unsigned i = 0; i < n; ++i) { // keep the blocks that are really freed
+        if (!block_unref(dev, blocks[i])) {
+            blocks[k++] = blocks[i];
+        }
+    }
+    free_later(dev, blocks, k);
 }
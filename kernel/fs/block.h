@@ -6,5 +6,14 @@
 void      block_init(devno_t dev);
 void      block_zero(devno_t dev, blockno_t blockno);
 void      block_super(devno_t dev, SuperBlock *, bool update);
+void      block_super_sync(devno_t dev);
 blockno_t block_alloc(devno_t dev);
+unsigned  block_alloc_range(devno_t dev, unsigned want, blockno_t *start);
 void      block_free(devno_t dev, blockno_t blockno);
+void      block_free_batch(devno_t dev, blockno_t *blocks, unsigned n);
+void      block_free_pending();
+unsigned  block_refcnt(devno_t dev, blockno_t blockno);
+bool      block_ref(devno_t dev, blockno_t blockno);
+void      block_seg_init(devno_t dev);
+unsigned  block_seg_clean();
+bool      block_seg_victim(blockno_t *start, blockno_t *end);
@@ -0,0 +1,188 @@
+#include "defs.h"
+#include "err.h"
+#include "string.h"
+#include "process.h"
+#include "process/spinlock.h"
+#include "fs/fdefs.h"
+#include "fs/bcache.h"
+#include "fs/block.h"
+#include "fs/inode.h"
+#include "fs/log.h"
+#include "fs/cleaner.h"
+
+/* Segment cleaner of SB_LFS file systems.
+ *
+ * The allocator fills one segment at a time and needs clean segments to
+ * keep writing in order, see block.c. Overwritten blocks are freed where
+ * they were, so old segments end up partly used. The `cleaner` kernel
+ * thread moves the live blocks of the least used segment to the head and
+ * the segment becomes clean.
+ *
+ * A block doesn't record its owner, the cleaner finds it by walking the
+ * block pointers of every allocated inode. With MAXINODES inodes of at
+ * most MAXFILE blocks this is cheap next to the disk IO it saves. Blocks
+ * shared by clones are left in place: moving one would need every owner
+ * updated in the same transaction.
+ *
+ * Moved file data is written through before the new pointer is logged.
+ * Directory blocks and indirect blocks are metadata, they go through
+ * the log like any other update.
+ * */
+
+#define NCLEAN    8 // max blocks moved per transaction
+#define CLEANHIGH 4 // clean segments the cleaner aims for
+
+
+typedef struct Cleaner {
+    SpinLock lk;
+    devno_t  dev;
+    bool     pending; // the allocator is short of clean segments
+} Cleaner;
+
+
+Cleaner           cleaner;
+extern SuperBlock super_block;
+
+
+void cleaner_init(devno_t dev) {
+    cleaner.lk      = new_lock("cleaner.lk");
+    cleaner.dev     = dev;
+    cleaner.pending = false;
+}
+
+
+/*! Tell the cleaner clean segments are running out */
+void cleaner_kick() {
+    lock(&cleaner.lk);
+    cleaner.pending = true;
+    wakeup(&cleaner);
+    unlock(&cleaner.lk);
+}
+
+
+/*! Move block `old` of a locked inode to the head, out of [lo, hi).
+ *  Needs to run inside a transaction. The caller logs the new pointer
+ *  after, `old` is reused only once that commits, see `block_free`.
+ *  @meta    the block is metadata, log it.
+ *  @copy    false for an unwritten block, its content doesn't matter.
+ *  @return  the new blockno, 0 if failed.
+ * */
+static blockno_t move_block(Inode *ino, blockno_t old, blockno_t lo, blockno_t hi, bool meta, bool copy) {
+    blockno_t nb;
+    if (block_alloc_range(ino->dev, 1, &nb) == 0)
+        return 0;
+    if (nb >= lo && nb < hi) { // no clean segment left, the head is the victim
+        block_free(ino->dev, nb);
+        return 0;
+    }
+
+    if (copy) {
+        BNode *from = bcache_read(ino->dev, old, false);
+        BNode *to   = bcache_get(ino->dev, nb);
+        memmove(to->cache, from->cache, BSIZE); // a logged `from` is the latest
+        if (meta) {
+            log_write(to);
+            bcache_release(from);
+            bcache_release(to);
+        } else { // file data is not kept in the bcache, see pcache.c
+            bcache_write_batch(&to, 1);
+            bcache_forget(from);
+        }
+    }
+    block_free(ino->dev, old);
+    return nb;
+}
+
+
+/*! Move the blocks of an inode out of [lo, hi), NCLEAN blocks per
+ *  transaction.
+ *  @return  false if a block is left in the range.
+ * */
+static bool clean_inode(Inode *ino, blockno_t lo, blockno_t hi) {
+    bool     ok  = true;
+    unsigned nth = 0;
+
+    while (nth < MAXFILE) {
+        unsigned moved = 0;
+        log_begin();
+        inode_lock(ino);
+        if (ino->d.type != F_FILE && ino->d.type != F_DIR)
+            nth = MAXFILE; // free or device
+
+        blockno_t ind = ino->d.addrs[NDIRECT];
+        if (nth < MAXFILE && ind >= lo && ind < hi) {
+            if ((ind = move_block(ino, ind, lo, hi, true, true)) != 0) {
+                ino->d.addrs[NDIRECT] = ind;
+                inode_flush(ino);
+                moved++;
+            } else {
+                ok  = false;
+                nth = MAXFILE;
+            }
+        }
+
+        for (; nth < MAXFILE && moved < NCLEAN; ++nth) {
+            blockno_t p = inode_bptr(ino, nth);
+            blockno_t a = BLK_ADDR(p);
+            if (a < lo || a >= hi)
+                continue;
+            if (block_refcnt(ino->dev, a) > 0) { // shared by a clone
+                ok = false;
+                continue;
+            }
+
+            bool meta = ino->d.type == F_DIR;
+            if ((a = move_block(ino, a, lo, hi, meta, !(p & BLK_UNWRITTEN))) == 0) {
+                ok  = false;
+                nth = MAXFILE;
+                break;
+            }
+            inode_setptr(ino, nth, a | (p & BLK_FLAGS));
+            moved++;
+        }
+        inode_unlock(ino);
+        log_end();
+    }
+    return ok;
+}
+
+
+/*! Move every live block out of [lo, hi).
+ *  @return  false if some blocks are left.
+ * */
+static bool clean_segment(blockno_t lo, blockno_t hi) {
+    bool ok = true;
+
+    for (inodeno_t inum = 1; inum < super_block.ninodes; ++inum) {
+        Inode *ino;
+        if (!inode_used(cleaner.dev, inum))
+            continue;
+        if ((ino = inode_get(cleaner.dev, inum)) == 0)
+            return false; // icache is full
+        if (inode_used(cleaner.dev, inum)) // not freed while we got it
+            ok = clean_inode(ino, lo, hi) && ok;
+        inode_drop(ino);
+    }
+    return ok;
+}
+
+
+/*! Kernel thread that cleans segments when the allocator runs short.
+ *  It stops early if a segment can't be cleaned completely, and waits
+ *  for the next kick.
+ * */
+void cleaner_daemon() {
+    for (;;) {
+        lock(&cleaner.lk);
+        while (!cleaner.pending)
+            sleep(&cleaner, &cleaner.lk);
+        cleaner.pending = false;
+        unlock(&cleaner.lk);
+
+        blockno_t lo, hi;
+        while (block_seg_clean() < CLEANHIGH && block_seg_victim(&lo, &hi)) {
+            if (!clean_segment(lo, hi))
+                break;
+        }
+    }
+}
@@ -0,0 +1,8 @@
+#pragma once
+#include "fdefs.fwd.h"
+#include "fs/fdefs.h"
+
+
+void cleaner_init(devno_t dev);
+void cleaner_kick();
+void cleaner_daemon();
@@ -0,0 +1,179 @@
+#include "defs.h"
+#include "string.h"
+#include "process/spinlock.h"
+#include "fs/fdefs.h"
+#include "fs/dir.h"
+#include "fs/dcache.h"
+
+/* Directory name lookup cache.
+ *
+ * Resolving a path component needs a scan over the parent directory.
+ * The dcache remembers the result of each `dir_lookup` keyed on
+ * (dev, parent inum, name), so resolving the same path again doesn't
+ * touch the directory blocks at all.
+ *
+ * A cached inum of 0 is a negative entry, it records that the name
+ * doesn't exist in the parent. Any operation that changes a directory
+ * entry needs to update the dcache, otherwise a stale (or negative)
+ * entry will shadow the directory content.
+ *
+ * Entries are chained in NDCHASH hash buckets and linked in a circular
+ * LRU list. `head` is the most recently used entry and `head->prev` is
+ * the one that gets recycled on a miss.
+ * */
+
+#define NDCHASH 64 // number of hash buckets
+
+
+typedef struct DEntry {
+    struct DEntry *next;   // LRU list
+    struct DEntry *prev;
+    struct DEntry *hnext;  // hash chain
+    bool           valid;
+    devno_t        dev;
+    inodeno_t      parent; // inum of the parent directory
+    inodeno_t      inum;   // 0 for negative entry
+    offset_t       offset; // offset of the DirEntry in the parent
+    char           name[DIRNAMESZ];
+} DEntry;
+
+
+typedef struct DCache {
+    SpinLock lk;
+    DEntry  *head;
+    DEntry  *hash[NDCHASH];
+    DEntry   entries[NDCACHE];
+} DCache;
+
+
+DCache dcache;
+
+
+void dcache_init() {
+    dcache.lk = new_lock("dcache.lk");
+
+    for (int i = 0; i < NDCACHE; ++i) {
+        DEntry *d = &dcache.entries[i];
+        d->next   = &dcache.entries[(i + 1) % NDCACHE];
+        d->prev   = &dcache.entries[(i + NDCACHE - 1) % NDCACHE];
+        d->hnext  = 0;
+        d->valid  = false;
+    }
+    dcache.head = &dcache.entries[0];
+}
+
+
+static unsigned dcache_bucket(devno_t dev, inodeno_t parent, const char *name) {
+    return (dir_namehash(name) ^ (parent * 2654435761u) ^ dev) % NDCHASH;
+}
+
+
+/*! Find the entry for `name` in `parent`. Return 0 if not cached. */
+static DEntry *dcache_find(devno_t dev, inodeno_t parent, const char *name) {
+    DEntry *d = dcache.hash[dcache_bucket(dev, parent, name)];
+    for (; d; d = d->hnext) {
+        if (d->dev == dev && d->parent == parent && dir_namecmp(d->name, name) == 0)
+            return d;
+    }
+    return 0;
+}
+
+
+/*! Remove the entry from its hash chain */
+static void dcache_unhash(DEntry *d) {
+    DEntry **pp = &dcache.hash[dcache_bucket(d->dev, d->parent, d->name)];
+    for (; *pp; pp = &(*pp)->hnext) {
+        if (*pp == d) {
+            *pp = d->hnext;
+            break;
+        }
+    }
+    d->hnext = 0;
+    d->valid = false;
+}
+
+
+/*! Move the entry to the head of the LRU list */
+static void dcache_touch(DEntry *d) {
+    if (d == dcache.head)
+        return;
+
+    d->prev->next           = d->next;
+    d->next->prev           = d->prev;
+    d->next                 = dcache.head;
+    d->prev                 = dcache.head->prev;
+    dcache.head->prev->next = d;
+    dcache.head->prev       = d;
+    dcache.head             = d;
+}
+
+
+/*! Look up `name` in the directory `parent`.
+ *  @inum    output, the inode number of the entry. 0 for negative entry.
+ *  @offset  output, offset of the entry in the directory. Can be 0.
+ *  @return  true if the name is cached.
+ * */
+bool dcache_lookup(devno_t dev, inodeno_t parent, const char *name, inodeno_t *inum, offset_t *offset) {
+    DEntry *d;
+    lock(&dcache.lk);
+    if ((d = dcache_find(dev, parent, name)) == 0) {
+        unlock(&dcache.lk);
+        return false;
+    }
+
+    dcache_touch(d);
+    *inum = d->inum;
+    if (offset) *offset = d->offset;
+    unlock(&dcache.lk);
+    return true;
+}
+
+
+/*! Cache the lookup result of `name` in `parent`. Pass `inum` 0 to
+ *  record a negative entry. Existing entry for the same name is replaced.
+ * */
+void dcache_enter(devno_t dev, inodeno_t parent, const char *name, inodeno_t inum, offset_t offset) {
+    DEntry *d;
+    lock(&dcache.lk);
+
+    if ((d = dcache_find(dev, parent, name)) == 0) {
+        d = dcache.head->prev; // least recently used
+        if (d->valid)
+            dcache_unhash(d);
+
+        d->dev    = dev;
+        d->parent = parent;
+        strncpy(d->name, name, DIRNAMESZ);
+
+        unsigned h     = dcache_bucket(dev, parent, d->name);
+        d->hnext       = dcache.hash[h];
+        dcache.hash[h] = d;
+        d->valid       = true;
+    }
+
+    d->inum   = inum;
+    d->offset = offset;
+    dcache_touch(d);
+    unlock(&dcache.lk);
+}
+
+
+/*! Drop the cached entry of `name` in `parent` */
+void dcache_invalidate(devno_t dev, inodeno_t parent, const char *name) {
+    DEntry *d;
+    lock(&dcache.lk);
+    if ((d = dcache_find(dev, parent, name)) != 0)
+        dcache_unhash(d);
+    unlock(&dcache.lk);
+}
+
+
+/*! Drop all cached entries of the directory `parent` */
+void dcache_purge(devno_t dev, inodeno_t parent) {
+    lock(&dcache.lk);
+    for (DEntry *d = dcache.entries; d < &dcache.entries[NDCACHE]; ++d) {
+        if (d->valid && d->dev == dev && d->parent == parent)
+            dcache_unhash(d);
+    }
+    unlock(&dcache.lk);
+}
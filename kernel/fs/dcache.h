@@ -0,0 +1,10 @@
+#pragma once
+#include <stdbool.h>
+#include "fdefs.fwd.h"
+
+
+void dcache_init();
+bool dcache_lookup(devno_t dev, inodeno_t parent, const char *name, inodeno_t *inum, offset_t *offset);
+void dcache_enter(devno_t dev, inodeno_t parent, const char *name, inodeno_t inum, offset_t offset);
+void dcache_invalidate(devno_t dev, inodeno_t parent, const char *name);
+void dcache_purge(devno_t dev, inodeno_t parent);
@@ -5,6 +5,9 @@
 #include "fdefs.fwd.h"
 #include "fdefs.h"
 #include "fs/dir.h"
+#include "fs/bcache.h"
+#include "fs/dcache.h"
+#include "fs/log.h"
 
 
 int dir_namecmp(const char *a, const char *b) {
@@ -12,9 +15,330 @@ int dir_namecmp(const char *a, const char *b) {
 }
 
 
+/*! FNV-1a hash of a directory name */
+unsigned dir_namehash(const char *name) {
+    unsigned h = 2166136261u;
+    for (int i = 0; i < DIRNAMESZ && name[i]; ++i) {
+        h ^= (unsigned char)name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+
+/* Directory blocks are metadata, every update goes through the log.
+ * Functions that modify a directory need to run inside a transaction.
+ * */
+
+
+/* Indexed directories
+ *
+ * A linear directory is a sequence of directory blocks, a lookup needs
+ * to scan all of them. Once a linear directory outgrows its first block
+ * it's converted into a hash indexed directory (I_INDEX):
+ *
+ *     [ root | leaf | leaf | ... ]
+ *
+ * Block 0 is the root. It holds a `DxRoot` header followed by `DxEntry`
+ * pairs sorted by hash. The nth pair covers names whose `dir_namehash`
+ * is in [pairs[n].hash, pairs[n+1].hash) and points to the leaf that
+ * holds them. Leaves use the same format as linear directory blocks.
+ *
+ * A lookup binary searches the root and scans a single leaf, so it
+ * costs 2 block reads no matter how big the directory is. When a leaf is
+ * full, the upper half of its entries (ordered by hash) is moved to a new
+ * leaf appended to the directory, and a pair for the new leaf is inserted
+ * in the root. Names with the same hash always stay in the same leaf, so
+ * a leaf full of colliding names can't be split.
+ *
+ * Leaves are never merged, removing an entry just clears its slot.
+ * */
+
+#define DX_MAGIC 0x64786972 // "dxir"
+#define DX_LIMIT ((BSIZE - sizeof(DxRoot)) / sizeof(DxEntry))
+
+
+typedef struct DxRoot {
+    unsigned magic;
+    unsigned count; // number of DxEntry in use
+} DxRoot;
+
+
+typedef struct DxEntry {
+    unsigned hash;  // lowest hash stored in the leaf
+    unsigned nth;   // leaf block number in the directory
+} DxEntry;
+
+
+static bool dir_indexed(const Inode *dir) {
+    return dir->d.flags & I_INDEX;
+}
+
+
+static DxEntry *dx_entries(BNode *root) {
+    return (DxEntry *)&root->cache[sizeof(DxRoot)];
+}
+
+
+/*! Read the nth block of the directory */
+static BNode *dir_block(Inode *dir, unsigned nth) {
+    return bcache_read(dir->dev, inode_bmap(dir, nth), false);
+}
+
+
+/*! Append a zeroed block to the directory.
+ *  @nth     output, block number of the new block in the directory
+ *  @return  the bnode of the new block. 0 if the directory can't grow.
+ * */
+static BNode *dir_grow(Inode *dir, unsigned *nth) {
+    blockno_t blockno;
+    *nth = dir->d.size / BSIZE;
+    if (*nth >= MAXFILE)
+        return 0;
+    if ((blockno = inode_bmap(dir, *nth)) == 0)
+        return 0;
+    dir->d.size += BSIZE;
+    inode_flush(dir);
+    return bcache_read(dir->dev, blockno, false);
+}
+
+
+/*! Compare entries of a directory block in place.
+ *  If `name` is 0, look for the first empty slot instead.
+ *  @return  the slot index in the block, -1 if not found.
+ * */
+static int dir_scan_block(BNode *b, const char *name) {
+    DirEntry *entries = (DirEntry *)b->cache;
+    for (unsigned i = 0; i < DIRPERBLK; ++i) {
+        DirEntry *e = &entries[i];
+        if (name ? (e->inum != 0 && dir_namecmp(e->name, name) == 0)
+                 : (e->inum == 0))
+            return i;
+    }
+    return -1;
+}
+
+
+/*! Find the index of the pair in the root covering `hash` */
+static unsigned dx_search(BNode *root, unsigned hash) {
+    DxEntry *pairs = dx_entries(root);
+    unsigned lo    = 0;
+    unsigned hi    = ((DxRoot *)root->cache)->count;
+
+    while (hi - lo > 1) {
+        unsigned mid = (lo + hi) / 2;
+        if (pairs[mid].hash <= hash) lo = mid;
+        else                         hi = mid;
+    }
+    return lo;
+}
+
+
+/*! Scan the directory one block at a time. Each directory block is
+ *  mapped once and all entries in it are compared in place, instead of
+ *  reading entries one by one through `inode_read`.
+ *
+ *  Indexed directories only scan the leaf the name hashes to.
+ *  If `name` is 0, look for the first empty slot of a linear directory.
+ *  @dir     directory inode
+ *  @name    entry name to look for, or 0 for an empty slot
+ *  @offset  output, offset of the entry in the directory
+ *  @return  the bnode that holds the entry, the caller needs to release it.
+ *           0 if not found.
+ * */
+static BNode *dir_scan(Inode *dir, const char *name, offset_t *offset) {
+    BNode *b;
+    int    i;
+
+    if (name && dir_indexed(dir)) {
+        BNode   *root = dir_block(dir, 0);
+        unsigned nth  = dx_entries(root)[dx_search(root, dir_namehash(name))].nth;
+        bcache_release(root);
+
+        b = dir_block(dir, nth);
+        if ((i = dir_scan_block(b, name)) < 0) {
+            bcache_release(b);
+            return 0;
+        }
+        *offset = nth * BSIZE + i * sizeof(DirEntry);
+        return b;
+    }
+
+    for (unsigned nth = 0; nth * BSIZE < dir->d.size; ++nth) {
+        b = dir_block(dir, nth);
+        if ((i = dir_scan_block(b, name)) >= 0) {
+            *offset = nth * BSIZE + i * sizeof(DirEntry);
+            return b;
+        }
+        bcache_release(b);
+    }
+    return 0;
+}
+
+
+/*! Get the entry at `offset` from the bnode returned by `dir_scan` */
+static DirEntry *dir_entry(BNode *b, offset_t offset) {
+    return (DirEntry *)&b->cache[offset % BSIZE];
+}
+
+
+/*! Convert a full single block linear directory into an indexed one.
+ *  The old block is moved to a leaf and block 0 becomes the root.
+ * */
+static bool dx_create(Inode *dir) {
+    BNode   *leaf;
+    BNode   *root;
+    unsigned nth;
+
+    if ((leaf = dir_grow(dir, &nth)) == 0)
+        return false;
+
+    root = dir_block(dir, 0);
+    memmove(leaf->cache, root->cache, BSIZE);
+    memset(root->cache, 0, BSIZE);
+    ((DxRoot *)root->cache)->magic = DX_MAGIC;
+    ((DxRoot *)root->cache)->count = 1;
+    dx_entries(root)[0]            = (DxEntry){ .hash = 0, .nth = nth };
+
+    log_write(leaf);
+    log_write(root);
+    bcache_release(leaf);
+    bcache_release(root);
+
+    dir->d.flags |= I_INDEX;
+    inode_flush(dir);
+    dcache_purge(dir->dev, dir->inum);
+    return true;
+}
+
+
+/*! Split the full leaf covered by the `idx`th pair of the root.
+ *  The upper half of the entries by hash is moved to a new leaf.
+ *  @return  false if the root is full or the leaf can't be split.
+ * */
+static bool dx_split(Inode *dir, BNode *root, unsigned idx) {
+    DxRoot  *hdr   = (DxRoot *)root->cache;
+    DxEntry *pairs = dx_entries(root);
+    DirEntry entries[DIRPERBLK];
+    unsigned hashes[DIRPERBLK];
+    BNode   *leaf;
+    BNode   *next;
+    unsigned nth;
+    unsigned k;
+
+    if (hdr->count >= DX_LIMIT)
+        return false;
+
+    // sort entries of the leaf by hash
+    leaf = dir_block(dir, pairs[idx].nth);
+    memmove(entries, leaf->cache, sizeof(entries));
+    for (unsigned i = 0; i < DIRPERBLK; ++i) {
+        DirEntry e = entries[i];
+        unsigned h = dir_namehash(e.name);
+        unsigned j = i;
+        for (; j > 0 && hashes[j - 1] > h; --j) {
+            entries[j] = entries[j - 1];
+            hashes[j]  = hashes[j - 1];
+        }
+        entries[j] = e;
+        hashes[j]  = h;
+    }
+
+    // split point, names with the same hash stay together.
+    for (k = DIRPERBLK / 2; k < DIRPERBLK && hashes[k] == hashes[k - 1]; ++k);
+    if (k == DIRPERBLK)
+        for (k = DIRPERBLK / 2; k > 0 && hashes[k] == hashes[k - 1]; --k);
+    if (k == 0) {
+        bcache_release(leaf);
+        return false;
+    }
+
+    if ((next = dir_grow(dir, &nth)) == 0) {
+        bcache_release(leaf);
+        return false;
+    }
+
+    memset(leaf->cache, 0, BSIZE);
+    memmove(leaf->cache, entries, k * sizeof(DirEntry));
+    memmove(next->cache, &entries[k], (DIRPERBLK - k) * sizeof(DirEntry));
+
+    memmove(&pairs[idx + 2], &pairs[idx + 1], (hdr->count - idx - 1) * sizeof(DxEntry));
+    pairs[idx + 1] = (DxEntry){ .hash = hashes[k], .nth = nth };
+    hdr->count++;
+
+    log_write(leaf);
+    log_write(next);
+    log_write(root);
+    bcache_release(leaf);
+    bcache_release(next);
+    dcache_purge(dir->dev, dir->inum);
+    return true;
+}
+
+
+/*! Insert an entry into an indexed directory */
+static bool dx_link(Inode *dir, DirEntry *new_entry, offset_t *offset) {
+    unsigned hash = dir_namehash(new_entry->name);
+    BNode   *root = dir_block(dir, 0);
+
+    if (((DxRoot *)root->cache)->magic != DX_MAGIC)
+        panic("dx_link: bad index root");
+
+    for (int retry = 0; retry < 2; ++retry) {
+        unsigned idx = dx_search(root, hash);
+        unsigned nth = dx_entries(root)[idx].nth;
+        BNode   *b   = dir_block(dir, nth);
+        int      i;
+
+        if ((i = dir_scan_block(b, 0)) >= 0) {
+            ((DirEntry *)b->cache)[i] = *new_entry;
+            log_write(b);
+            bcache_release(b);
+            bcache_release(root);
+            *offset = nth * BSIZE + i * sizeof(DirEntry);
+            return true;
+        }
+        bcache_release(b);
+
+        if (!dx_split(dir, root, idx))
+            break;
+    }
+
+    bcache_release(root);
+    return false;
+}
+
+
+/*! Insert an entry into a linear directory. Grow the directory if
+ *  there is no empty slot, or convert it into an indexed directory
+ *  once it outgrows its first block.
+ * */
+static bool dir_linear_link(Inode *dir, DirEntry *new_entry, offset_t *offset) {
+    BNode   *b;
+    unsigned nth;
+
+    if ((b = dir_scan(dir, 0, offset)) == 0) {
+        if (dir->d.size == BSIZE) {
+            return dx_create(dir) && dx_link(dir, new_entry, offset);
+        }
+        if ((b = dir_grow(dir, &nth)) == 0)
+            return false;
+        *offset = nth * BSIZE;
+    }
+
+    *dir_entry(b, *offset) = *new_entry;
+    log_write(b);
+    bcache_release(b);
+    return true;
+}
+
+
 /*! Look up for a directory entry. If found, return the inode of the
  *  dir entry and set `offset` to offet of the entry.
  *  If not found, return 0;
+ *
+ *  The result is cached in the dcache, the directory is only scanned
+ *  when the name is not cached.
  *  @dir     directory inode
  *  @name    directory name
  *  @offset  output pointer, stores the location of the entry in the director
@@ -23,80 +347,196 @@ int dir_namecmp(const char *a, const char *b) {
 Inode *dir_lookup(Inode *dir, char *name, offset_t *offset) {
     if (dir->d.type != F_DIR)
         panic("dir_lookup, not a dir");
-    DirEntry entry;
+    BNode    *b;
+    offset_t  off;
+    inodeno_t inum;
 
-    for (offset_t off = 0; off < dir->d.size; off += sizeof(DirEntry)) {
-        if (inode_read(dir, (char *)&entry, off, sizeof(DirEntry)) != sizeof(DirEntry))
-            panic("dir_lookup: invalid dir");
-
-        if (entry.inum == 0)
-            continue;
+    if (dcache_lookup(dir->dev, dir->inum, name, &inum, offset)) {
+        if (inum == 0) return 0; // negative entry
+        return inode_get(dir->dev, inum);
+    }
 
-        if (dir_namecmp(entry.name, name)  == 0) {
-            if (offset) *offset = off;
-            return inode_get(dir->dev, entry.inum);
-        }
+    if ((b = dir_scan(dir, name, &off)) == 0) {
+        dcache_enter(dir->dev, dir->inum, name, 0, 0);
+        return 0;
     }
 
-    return 0;
+    inum = dir_entry(b, off)->inum;
+    bcache_release(b);
+    if (offset) *offset = off;
+    dcache_enter(dir->dev, dir->inum, name, inum, off);
+    return inode_get(dir->dev, inum);
 }
 
 
-/*! Add a new directory entry to the directory */
+/*! Add a new directory entry to the directory.
+ *  @return  false if the entry exists or the directory is full.
+ * */
 bool dir_link(Inode *dir, DirEntry new_entry) {
     if (dir->d.type != F_DIR)
         panic("dir_link: not a dir");
 
-    Inode *ino;
-    DirEntry entry;
+    Inode   *ino;
+    offset_t off;
+    bool     ok;
 
     if ((ino = dir_lookup(dir, new_entry.name, 0)) != 0) {  // exists
         inode_drop(ino);
         return false;
     }
 
-    for (offset_t off = 0; off < dir->d.size; off += sizeof(DirEntry)) {
-        if (inode_read(dir, (char *)&entry, off, sizeof(DirEntry)) != sizeof(DirEntry))
-            panic("dir_link: invalid dir");
+    if (dir_indexed(dir)) ok = dx_link(dir, &new_entry, &off);
+    else                  ok = dir_linear_link(dir, &new_entry, &off);
 
-        if (entry.inum == 0) { // empty dir entry.
-            if (inode_write(dir, (char *)&new_entry, off, sizeof(DirEntry) != sizeof(DirEntry)))
-                panic("dir_link: write error");
-            return true;
+    if (ok)
+        dcache_enter(dir->dev, dir->inum, new_entry.name, new_entry.inum, off);
+    return ok;
+}
+
+
+/*! Remove the entry `name` from the directory.
+ *  The link count of the unlinked inode is not changed, it's up
+ *  to the caller to update it.
+ *  @return  false if the entry doesn't exist.
+ * */
+bool dir_unlink(Inode *dir, char *name) {
+    if (dir->d.type != F_DIR)
+        panic("dir_unlink: not a dir");
+
+    BNode   *b;
+    offset_t off;
+
+    if ((b = dir_scan(dir, name, &off)) == 0)
+        return false;
+
+    memset(dir_entry(b, off), 0, sizeof(DirEntry));
+    log_write(b);
+    bcache_release(b);
+    dcache_enter(dir->dev, dir->inum, name, 0, 0);
+    return true;
+}
+
+
+/*! Fill `buf` with as many `Dirent` records as fit, starting from the
+ *  directory offset `*offset`. Empty slots and the index root are skipped.
+ *  Each directory block is mapped once for all of its entries.
+ *  @offset  in/out, directory offset to start from. Updated to the offset
+ *           of the first entry not returned.
+ *  @return  number of bytes filled, 0 at the end of the directory, -1 if
+ *           the buffer is too small for the next record.
+ * */
+int dir_getdents(Inode *dir, offset_t *offset, char *buf, unsigned n) {
+    if (dir->d.type != F_DIR)
+        panic("dir_getdents: not a dir");
+
+    unsigned nth = *offset / BSIZE;
+    unsigned i   = (*offset % BSIZE) / sizeof(DirEntry);
+    unsigned rd  = 0;
+
+    if (dir_indexed(dir) && nth == 0) {
+        nth = 1;
+        i   = 0;
+    }
+
+    for (; nth * BSIZE < dir->d.size; ++nth, i = 0) {
+        BNode    *b       = dir_block(dir, nth);
+        DirEntry *entries = (DirEntry *)b->cache;
+
+        for (; i < DIRPERBLK; ++i) {
+            DirEntry *e = &entries[i];
+            if (e->inum == 0)
+                continue;
+
+            unsigned namelen = strnlen(e->name, DIRNAMESZ);
+            unsigned reclen  = (sizeof(Dirent) + namelen + 1 + 3) & ~3;
+            if (rd + reclen > n) {
+                bcache_release(b);
+                *offset = nth * BSIZE + i * sizeof(DirEntry);
+                return rd ? (int)rd : -1;
+            }
+
+            Dirent *d = (Dirent *)&buf[rd];
+            d->inum   = e->inum;
+            d->off    = nth * BSIZE + (i + 1) * sizeof(DirEntry);
+            d->reclen = reclen;
+            memmove(d->name, e->name, namelen);
+            memset(&d->name[namelen], 0, reclen - sizeof(Dirent) - namelen);
+            rd += reclen;
         }
+        bcache_release(b);
     }
 
-    return false; // no empty space
+    *offset = dir->d.size;
+    return rd;
 }
 
 
-/*! Get an inode from a path name. */
+/*! Get an inode from a path name.
+ *  The returned inode is referenced, the caller needs to drop it.
+ *  @path    absolute path
+ *  @n       length of the path
+ *  @return  the inode of the path, 0 if the path doesn't exist.
+ * */
 Inode *dir_abspath(char *path, size_t n) {
     char  buf[512];
     char *saveptr;
 
     if (!path) return 0;
     if (path[0] != '/') return 0;
+    if (n >= sizeof(buf)) return 0;
+
+    memmove(buf, path, n);
+    buf[n] = '\0';
 
-    Inode *root = inode_get(ROOTDEV, ROOTINO);
-    Inode *ino  = root;
+    Inode *ino = inode_get(ROOTDEV, ROOTINO);
 
-    for (char *tok  = strtok_r(path, "/", &saveptr);
+    for (char *tok  = strtok_r(buf, "/", &saveptr);
                tok != 0;
                tok  = strtok_r(0, "/", &saveptr)) {
-        offset_t off;
-        Inode   *ino1;
-        if ((ino1 = dir_lookup(ino, tok, &off)) == 0) return 0;
-        switch (ino1->d.type) {
-        case F_DIR:
-            // TODO
-            ino = ino1;
-            continue;
-        case F_FILE:
-        default:
-            panic("dis_abspath");
+        Inode *ino1;
+        inode_lock(ino);
+        if (ino->d.type != F_DIR) {
+            inode_unlock(ino);
+            inode_drop(ino);
+            return 0;
         }
+        ino1 = dir_lookup(ino, tok, 0);
+        inode_unlock(ino);
+        inode_drop(ino);
+        if ((ino = ino1) == 0) return 0;
     }
 
-    return 0;
+    return ino;
+}
+
+
+/*! Get the parent directory of a path name.
+ *  The returned inode is referenced, the caller needs to drop it.
+ *  @path    absolute path
+ *  @n       length of the path
+ *  @name    output, the last component of the path. DIRNAMESZ bytes.
+ *  @return  the inode of the parent, 0 if it doesn't exist or the path
+ *           has no last component.
+ * */
+Inode *dir_abspath_parent(char *path, size_t n, char *name) {
+    char buf[512];
+
+    if (!path) return 0;
+    if (path[0] != '/') return 0;
+    if (n >= sizeof(buf)) return 0;
+
+    memmove(buf, path, n);
+    buf[n] = '\0';
+    while (n > 1 && buf[n - 1] == '/') // trailing slashes
+        buf[--n] = '\0';
+
+    char *last = buf + n;
+    while (last[-1] != '/')
+        last--;
+    if (*last == '\0' || strlen(last) >= DIRNAMESZ)
+        return 0;
+
+    strncpy(name, last, DIRNAMESZ);
+    *last = '\0';
+    return dir_abspath(buf, last - buf);
 }
@@ -4,7 +4,11 @@
 #include "fs/fdefs.h"
 
 
-int    dir_namecmp(const char *a, const char *b);
-Inode *dir_lookup(Inode *dir, char *name, offset_t *offset);
-bool   dir_link(Inode *dir, DirEntry entry);
-Inode *dir_abspath(char *path, size_t n);
+int      dir_namecmp(const char *a, const char *b);
+unsigned dir_namehash(const char *name);
+Inode   *dir_lookup(Inode *dir, char *name, offset_t *offset);
+bool     dir_link(Inode *dir, DirEntry entry);
+bool     dir_unlink(Inode *dir, char *name);
+int      dir_getdents(Inode *dir, offset_t *offset, char *buf, unsigned n);
+Inode   *dir_abspath(char *path, size_t n);
+Inode   *dir_abspath_parent(char *path, size_t n, char *name);
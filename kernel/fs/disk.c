@@ -1,9 +1,11 @@
 #include "err.h"
 #include "fdefs.h"
+#include "process.h"
 #include "spinlock.h"
 #include "driver/ide.h"
 #include "driver/pic.h"
 #include "trap/traps.h"
+#include "trap/ncli.h"
 #include "fs/disk.h"
 
 #define SECN (BSIZE/SECSZ)        // number of sectors per block
@@ -116,17 +118,75 @@ void disk_sync(BNode *b, bool poll) {
         b->dirty = false;
 
     } else {
-        dq_enqueue(b);
+        disk_submit(b);
+        disk_wait(b);
+    }
+}
+
+
+/*! Queue the request for `b` and return without waiting.
+ *  The command is sent right away if the disk is idle, otherwise
+ *  `disk_handler` sends it when the requests before it are done.
+ *  Many requests can be in flight, use `disk_wait` to wait for each.
+ * */
+void disk_submit(BNode *b) {
+    if (synced(b))
+        panic("disk_submit: nothing to do");
+
+    push_cli(); // disk_handler also modifies the queue
+    bool idle = disk_queue.head == 0;
+    dq_enqueue(b);
+    if (idle)
         disk_cmd_request(b);
-        while (!synced(b)); // TODO should sleep if block is not synced yet.
+    pop_cli();
+}
+
+
+/*! Wait until the request for `b` is done. The process sleeps on `b`
+ *  until `disk_handler` wakes it up, interrupts stay off between the
+ *  check and the sleep so the wakeup can't be missed. There is no
+ *  process to put to sleep during boot, spin then.
+ * */
+void disk_wait(BNode *b) {
+    push_cli();
+    if (this_proc() == 0) {
+        pop_cli();
+        while (!synced(b));
+        return;
     }
+
+    lock(&disk_queue.lk);
+    while (!synced(b))
+        sleep(b, &disk_queue.lk);
+    unlock(&disk_queue.lk);
+    pop_cli();
+}
+
+
+/*! Write a batch of dirty nodes. The batch is sorted by block number
+ *  and queued at once, so the disk serves it in a single sweep.
+ * */
+void disk_sync_batch(BNode **bs, unsigned n) {
+    for (unsigned i = 1; i < n; ++i) { // insertion sort, batches are small
+        BNode   *b = bs[i];
+        unsigned j = i;
+        for (; j > 0 && bs[j - 1]->blockno > b->blockno; --j)
+            bs[j] = bs[j - 1];
+        bs[j] = b;
+    }
+
+    for (unsigned i = 0; i < n; ++i)
+        disk_submit(bs[i]);
+    for (unsigned i = 0; i < n; ++i)
+        disk_wait(bs[i]);
 }
 
 
 /*! Handle disk interrupt.
  *  Pending tasks from a queue, the head of the queue
  *  is the current active request. The handler processes
- *  requests in the order until there's no more tasks left.
+ *  requests in the order until there's no more tasks left,
+ *  and wakes up the process waiting for each in `disk_wait`.
   * */
 void disk_handler() {
     BNode *b = dq_dequeue();
@@ -139,6 +199,7 @@ void disk_handler() {
 
     b->valid = true;
     b->dirty = false;
+    wakeup_unlocked(b); // the interrupted code may hold the ptable lock
 
     if (disk_queue.head)
         disk_cmd_request(disk_queue.head);
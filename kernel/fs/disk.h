@@ -4,5 +4,8 @@
 
 void disk_init();
 void disk_sync(BNode *b, bool poll);
+void disk_submit(BNode *b);
+void disk_wait(BNode *b);
+void disk_sync_batch(BNode **bs, unsigned n);
 void disk_handler();
 void disk_free(devno_t dev, blockno_t blockno);
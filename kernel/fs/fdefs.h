@@ -1,6 +1,8 @@
 #pragma once
 #include <stdbool.h>
+#include <stdint.h>
 #include "defs.h"
+#include "mem.h"
 #include "fdefs.fwd.h"
 #include "process/mutex.h"
 
@@ -9,12 +11,25 @@ typedef struct SuperBlock {
     unsigned  nblocks;    // total size of fs in blocks
     unsigned  ninodes;    // number of inodes
     unsigned  ndata;      // number of data blocks
+    unsigned  nfree;      // number of free data blocks
+    unsigned  nifree;     // number of free inodes
+    unsigned  nlog;       // number of log blocks, excluding the header
+    blockno_t logstart;   // blockno of the log header
     blockno_t inodestart; // blockno of the first ino
+    blockno_t imapstart;  // blockno of the first inode bit map
     blockno_t bmapstart;  // blockno of the first free bit map
+    blockno_t refstart;   // blockno of the first block reference count
     blockno_t datastart;  // blockno of the first ino
+    inodeno_t orphan;     // head of the orphan list, 0 if empty
+    unsigned  flags;      // SB_* flags, set by mkfs
 } SuperBlock;
 
 
+/* Superblock flags */
+#define SB_LFS  0x0001 // log-structured block allocation, see block.c
+#define SEGBLKS 32     // blocks per segment of a SB_LFS file system
+
+
 /* In disk representation of an inode
  * `addrs` holds inode block addresses. The first 12 addresses are
  *  direct blocks, 13th address is singly indirect address, 14th
@@ -27,19 +42,48 @@ typedef struct DInode {
     unsigned short  major; // major device number
     unsigned short  minor; // minor device number
     unsigned short  nlink; // number of links in fs
+    unsigned short  flags; // I_* flags
     unsigned        size;  // size of the file
+    inodeno_t       orphan; // next inode on the orphan list, see orphan.c
     blockno_t       addrs[NINOBLKS];  // block address.
 } __attribute__((packed)) DInode;
 
 
+/* ioctl commands */
+#define FIOCLONE   1 // share all blocks of the file `arg` into an empty file
+#define FIOSETCOMP 2 // turn compression of an empty file on (arg 1) or off (0)
+
+
+/* Inode flags */
+#define I_INDEX    0x0001 // directory is hash indexed, see dir.c
+#define I_COMPRESS 0x0002 // file data is compressed page by page, see pcache.c
+
+
+/* Block pointer flags, stored in the high bits of `DInode.addrs` and of
+ * indirect block entries. Use BLK_ADDR to get the block number.
+ * */
+#define BLK_UNWRITTEN  0x80000000 // allocated but never written, reads as zeros
+#define BLK_COMPRESSED 0x40000000 // first block of a compressed page
+#define BLK_FLAGS      (BLK_UNWRITTEN | BLK_COMPRESSED)
+#define BLK_ADDR(p)    ((p) & ~BLK_FLAGS)
+
+
+/* File data is cached in pages of PGBLKS blocks, see pcache.c */
+#define PGBLKS (PAGE_SZ / BSIZE)
+
+
 /* Memory representation of an inode */
 typedef struct Inode {
-    devno_t   dev;  // device number
-    inodeno_t inum; // The index of inode from `super_block.inodestart`
-    int       nref; // ref count
-    Mutex     lk;
-    bool      read; // has been read from disk?
-    DInode    d;    // copy of disk inode.
+    devno_t      dev;     // device number
+    inodeno_t    inum;    // The index of inode from `super_block.inodestart`
+    int          nref;    // ref count
+    Mutex        lk;
+    bool         read;    // has been read from disk?
+    bool         mdirty;  // disk inode changed since the last fsync
+    struct Page *pdirty;  // dirty pages not written back yet, see pcache.c
+    unsigned     npdirty; // number of pages on `pdirty`
+    offset_t     dsize;   // size on the disk, behind d.size while pages past it are dirty
+    DInode       d;       // copy of disk inode.
 } Inode;
 
 
@@ -58,6 +102,24 @@ typedef struct BNode {
 } BNode;
 
 
+/* Page cache page, file data at (dev, inum, idx * PAGE_SZ) */
+typedef struct Page {
+    struct Page *next;    // LRU list
+    struct Page *prev;
+    struct Page *hnext;   // hash chain
+    struct Page *dnext;   // dirty list of the owner
+    devno_t      dev;
+    inodeno_t    inum;    // 0 if unused
+    unsigned     idx;     // page index in the file
+    Inode       *owner;   // referenced while the page is dirty
+    unsigned     dmask;   // dirty blocks of the page
+    unsigned     dirtied; // ticks when the page got dirty
+    unsigned     len;     // bytes of file data, the rest is past the end
+    unsigned     nref;    // users that keep the page in the cache
+    char        *data;    // PAGE_SZ bytes from palloc
+} Page;
+
+
 /* Devices need to implement this interface */
 typedef struct Dev {
     int (*read)(Inode *ino, char *addr, int n);
@@ -65,12 +127,31 @@ typedef struct Dev {
 } Dev;
 
 
-/* Directory entry */
+/* Directory entry
+ * Directory entries never cross a block boundary. Each directory block
+ * holds DIRPERBLK entries and the rest of the block is unused, so the
+ * size of a directory is always a multiple of BSIZE.
+ * */
 typedef struct DirEntry {
   inodeno_t inum;
   char      name[DIRNAMESZ];
 } DirEntry;
 
+#define DIRPERBLK (BSIZE / sizeof(DirEntry)) // entries per directory block
+
+
+/* Directory record returned by `getdents`.
+ * Records are packed one after another in the user buffer. `reclen` is
+ * the size of the whole record including the nul terminated name, rounded
+ * up to 4 bytes. `off` is the directory offset to continue from.
+ * */
+typedef struct Dirent {
+    inodeno_t      inum;
+    offset_t       off;
+    unsigned short reclen;
+    char           name[];
+} __attribute__((packed)) Dirent;
+
 
 /* file status */
 #define T_DIR  1 // directory
@@ -84,3 +165,17 @@ typedef struct Stat {
     short     nlink; // number of links
     unsigned  size;  // file size
 } Stat;
+
+
+/* File system usage, see `statfs` */
+typedef struct StatFs {
+    unsigned bsize;   // block size
+    unsigned blocks;  // number of data blocks
+    unsigned bfree;   // number of free data blocks
+    unsigned files;   // number of inodes
+    unsigned ffree;   // number of free inodes
+    unsigned zin;     // bytes given to the compressor
+    unsigned zout;    // bytes it wrote, headers included
+    uint64_t zcycles; // cpu cycles spent compressing
+    uint64_t dcycles; // cpu cycles spent decompressing
+} StatFs;
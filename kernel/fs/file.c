@@ -2,14 +2,20 @@
 #include "fdefs.fwd.h"
 #include "spinlock.h"
 #include "fs/inode.h"
+#include "fs/dir.h"
 #include "fs/file.h"
+#include "fs/log.h"
+#include "fs/bcache.h"
+#include "fs/orphan.h"
+#include "fs/pcache.h"
+#include "memory/slab.h"
+#include "string.h"
 
 /* file descriptor */
 
 
 typedef struct FTable {
-    SpinLock lk;
-    File     t[NFILE];
+    KCache *cache; // open files
 } FTable;
 
 
@@ -17,23 +23,21 @@ FTable ftable;
 
 
 void ftable_init() {
-    ftable.lk = new_lock("ftable.lk");
+    if ((ftable.cache = kcache_create("file", sizeof(File), 0)) == 0)
+        panic("ftable_init");
 }
 
 
-/*! Allocate a file from the ftable
+/*! Allocate a file
  *  @return Newly allocated file. 0 if failed.
  * */
 File *file_allocate() {
-    File *f = 0;
-    for (int i = 0; i < NFILE; ++i) {
-        *f = ftable.t[i];
-        if (f->nref == 0) {
-            f->nref = 1;
-            return f;
-        }
-    }
-    return 0;
+    File *f;
+    if ((f = kcache_alloc(ftable.cache)) == 0)
+        return 0;
+    memset(f, 0, sizeof(File));
+    f->nref = 1;
+    return f;
 }
 
 
@@ -42,7 +46,21 @@ File *file_dup(File *f) {
     if (f->nref < 1)
         panic("dup_file");
     f->nref++;
-    return 0;
+    return f;
+}
+
+
+/*! Drop a reference of the file, the last one releases the inode */
+void file_close(File *f) {
+    if (f->nref < 1)
+        panic("file_close");
+    if (--f->nref > 0)
+        return;
+    if (f->type == FD_INODE)
+        inode_drop(f->ino);
+    f->type = FD_NONE;
+    f->ino  = 0;
+    kcache_free(ftable.cache, f);
 }
 
 
@@ -66,9 +84,13 @@ int file_read(File *f, char *buf, int n) {
 }
 
 
-/*! Write to file descriptor  */
+/*! Write to file descriptor.
+ *  A large write is split into chunks, each in its own transaction, so
+ *  one operation never logs more than NOPBLKS metadata blocks.
+ * */
 int file_write(File *f, const char *buf, int n) {
-    int wt;
+    int wt, r = 0;
+    int max = ((NOPBLKS - 4) / 2) * BSIZE;
 
     if (!f->writable) return -1;
 
@@ -78,9 +100,123 @@ int file_write(File *f, const char *buf, int n) {
     case FD_PIPE:
         panic("file_read: pipe not supported");
     case FD_INODE:
-        if ((wt = inode_write(f->ino, buf, f->offset, n)))
-            f->offset += wt;
-        return wt;
+        for (wt = 0; wt < n;) {
+            int m = n - wt < max ? n - wt : max;
+            log_begin();
+            r = inode_write(f->ino, buf + wt, f->offset, m);
+            log_end();
+            if (r <= 0)
+                break;
+            f->offset += r;
+            wt        += r;
+            if (r != m)
+                break;
+        }
+        return wt > 0 ? wt : r;
     }
     return -1;
 }
+
+
+/*! Read directory records from a directory file descriptor.
+ *  See `dir_getdents` for the record format.
+ * */
+int file_getdents(File *f, char *buf, int n) {
+    if (!f->readable)            return -1;
+    if (f->type != FD_INODE)     return -1;
+    if (f->ino->d.type != F_DIR) return -1;
+    if (n <= 0)                  return -1;
+    return dir_getdents(f->ino, &f->offset, buf, n);
+}
+
+
+/*! Make the file durable. Write back its dirty pages in file order,
+ *  then commit the log so the inode is on the disk too. Writeback
+ *  updates block pointers, so it runs inside a transaction.
+ *  @datasync  fdatasync, skip the commit if the inode didn't change.
+ * */
+int file_fsync(File *f, bool datasync) {
+    if (f->type != FD_INODE) return -1;
+
+    Inode *ino = f->ino;
+    log_begin();
+    inode_lock(ino);
+    bool ok = pcache_flush(ino);
+    bool commit = !datasync || ino->mdirty;
+    ino->mdirty = false;
+    inode_unlock(ino);
+    log_end();
+
+    if (commit)
+        log_flush();
+    return ok ? 0 : -1;
+}
+
+
+/*! Shrink the file to `size` bytes. The cut off blocks are freed in
+ *  the background.
+ * */
+int file_truncate(File *f, offset_t size) {
+    int r;
+    if (!f->writable)        return -1;
+    if (f->type != FD_INODE) return -1;
+
+    log_begin();
+    inode_lock(f->ino);
+    r = orphan_truncate(f->ino, size);
+    inode_unlock(f->ino);
+    log_end();
+    return r;
+}
+
+
+/*! Preallocate [offset, offset + len) of the file, see `inode_fallocate` */
+int file_fallocate(File *f, offset_t offset, unsigned len) {
+    int r;
+    if (!f->writable)        return -1;
+    if (f->type != FD_INODE) return -1;
+
+    log_begin();
+    inode_lock(f->ino);
+    r = inode_fallocate(f->ino, offset, len);
+    inode_unlock(f->ino);
+    log_end();
+    return r;
+}
+
+
+/*! Make the empty file `dst` a copy of `src` that shares its blocks,
+ *  see `inode_clone`. No data is read or written.
+ * */
+int file_clone(File *dst, File *src) {
+    int r;
+    if (!dst->writable || !src->readable)               return -1;
+    if (dst->type != FD_INODE || src->type != FD_INODE) return -1;
+
+    Inode *a = dst->ino < src->ino ? dst->ino : src->ino; // lock order
+    Inode *b = dst->ino < src->ino ? src->ino : dst->ino;
+
+    log_begin();
+    inode_lock(a);
+    if (b != a) inode_lock(b);
+    r = inode_clone(dst->ino, src->ino);
+    if (b != a) inode_unlock(b);
+    inode_unlock(a);
+    log_end();
+    return r;
+}
+
+
+/*! Turn compression of the empty file on or off, see `inode_setcomp` */
+int file_setcomp(File *f, bool on) {
+    int r;
+    if (!f->writable)        return -1;
+    if (f->type != FD_INODE) return -1;
+
+    log_begin();
+    inode_lock(f->ino);
+    r = inode_setcomp(f->ino, on);
+    inode_unlock(f->ino);
+    log_end();
+    return r;
+}
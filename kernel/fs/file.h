@@ -3,6 +3,14 @@
 #include "fs/fdefs.h"
 
 
+/* open flags, see `fs_open` */
+#define O_RDONLY  0x000
+#define O_WRONLY  0x001
+#define O_RDWR    0x002
+#define O_ACCMODE 0x003
+#define O_CREATE  0x200 // create an empty file if it doesn't exist
+
+
 void  ftable_init();
 File *file_allocate();
 File *file_dup(File *);
@@ -10,3 +18,9 @@ void  file_close(File *);
 void  file_stat(File *, Stat *);
 int   file_read(File *, char *, int);
 int   file_write(File *, const char *, int);
+int   file_getdents(File *, char *, int);
+int   file_fsync(File *, bool datasync);
+int   file_truncate(File *, offset_t size);
+int   file_fallocate(File *, offset_t offset, unsigned len);
+int   file_clone(File *dst, File *src);
+int   file_setcomp(File *, bool on);
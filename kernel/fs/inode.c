@@ -4,6 +4,9 @@
 #include "string.h"
 #include "bcache.h"
 #include "block.h"
+#include "log.h"
+#include "orphan.h"
+#include "pcache.h"
 #include "defs.h"
 #include "err.h"
 #include "inode.h"
@@ -35,9 +38,96 @@ inline static blockno_t get_inode_block(inodeno_t inum) {
 }
 
 
+/* Inode bitmap
+ *
+ * One bit per inode, stored on disk from `super_block.imapstart`, the
+ * nth bit from MSB tells if inode n is used. The whole bitmap is cached
+ * in `imap.bits` at boot, so allocating an inode never reads the disk
+ * or scans DInodes. The disk bitmap is updated through the log.
+ *
+ * The number of free inodes is `super_block.nifree`.
+ *
+ * `imap.cursor` rotates over the bitmap: a search starts at the byte
+ * where the previous one found an inode, so the used inodes at the front
+ * aren't scanned again. Files are searched from their parent directory
+ * instead, so they land in the same inode block as the parent. New
+ * directories use the cursor and spread over the inode table.
+ * */
+#define IBITS_PER_BLK (BSIZE * 8)
+
+
+typedef struct IMap {
+    SpinLock      lk;
+    devno_t       dev;
+    unsigned      cursor; // byte to start the next search at
+    unsigned char bits[MAXINODES / 8];
+} IMap;
+
+
+IMap imap;
+
+
+/*! Load the inode bitmap of `dev`. Runs at boot, polls the disk. */
+static void imap_init(devno_t dev) {
+    unsigned nbytes = (super_block.ninodes + 7) / 8;
+    imap.lk     = new_lock("imap.lk");
+    imap.dev    = dev;
+    imap.cursor = 0;
+
+    if (super_block.ninodes > MAXINODES)
+        panic("imap_init: too many inodes");
+
+    for (unsigned off = 0; off < nbytes; off += BSIZE) {
+        BNode *b = bcache_read(dev, super_block.imapstart + off / BSIZE, true);
+        memmove(&imap.bits[off], b->cache, min(BSIZE, nbytes - off));
+        bcache_release(b);
+    }
+}
+
+
+/*! Find a free inode, starting from byte `start`. Called with imap.lk held. */
+static bool imap_search(unsigned start, inodeno_t *out) {
+    unsigned nbytes = (super_block.ninodes + 7) / 8;
+    for (unsigned k = 0; k < nbytes; ++k) {
+        unsigned      i    = (start + k) % nbytes;
+        unsigned char byte = imap.bits[i];
+
+        if (byte == 0xff) // all used
+            continue;
+
+        unsigned n = 0;
+        for (; byte & (0x80 >> n); ++n);
+        if (i * 8 + n >= super_block.ninodes)
+            continue;
+        *out = i * 8 + n;
+        return true;
+    }
+    return false;
+}
+
+
+/*! Update the bit of `inum` in the cache and on the disk */
+static void imap_set(inodeno_t inum, bool used) {
+    unsigned char mask = 0x80 >> (inum % 8);
+
+    lock(&imap.lk);
+    if (used) imap.bits[inum / 8] |= mask;
+    else      imap.bits[inum / 8] &= ~mask;
+    unlock(&imap.lk);
+
+    BNode         *b    = bcache_read(imap.dev, super_block.imapstart + inum / IBITS_PER_BLK, false);
+    unsigned char *byte = &((unsigned char *)b->cache)[(inum % IBITS_PER_BLK) / 8];
+    if (used) *byte |= mask;
+    else      *byte &= ~mask;
+    log_write(b);
+    bcache_release(b);
+}
+
+
 void inode_init() {
     vga_printf("[\033[32mboot\033[0m] inode...");
     icache.lk = new_lock("icache.lk");
+    imap_init(ROOTDEV);
     vga_printf("\033[32mok\033[0m\n");
 }
 
@@ -47,23 +137,26 @@ void inode_init() {
  *  Return 0 if there is not enough slots.
  * */
 Inode *inode_get(devno_t dev, inodeno_t inum) {
-    for (unsigned i = 0; i < sizeof(icache.inodes); ++i) {
-        Inode *ino = &icache.inodes[i];
-        if (ino->nref >= 0 && ino->dev == dev && ino->inum == inum) {
+    Inode *empty = 0;
+    for (Inode *ino = icache.inodes; ino < &icache.inodes[NINODE]; ++ino) {
+        if (ino->nref > 0 && ino->dev == dev && ino->inum == inum) {
             ino->nref++;
             return ino;
         }
 
-        if (ino->nref == 0) {
-            ino->nref = 1;
-            ino->dev  = dev;
-            ino->inum = inum;
-            ino->read = false;
-            return ino;
-        }
+        if (ino->nref == 0 && !empty)
+            empty = ino;
     }
 
-    return 0;
+    if (!empty)
+        return 0;
+
+    empty->nref   = 1;
+    empty->dev    = dev;
+    empty->inum   = inum;
+    empty->read   = false;
+    empty->mdirty = false;
+    return empty;
 }
 
 
@@ -79,20 +172,33 @@ bool inode_load(Inode *ino) {
 
     memmove(&ino->d, &b->cache[nth * sizeof(DInode)], sizeof(DInode));
     bcache_release(b);
-    ino->read = 1;
+    ino->read  = 1;
+    ino->dsize = ino->d.size;
     if (!ino->d.type)
         panic("inode_load: inode has no file type");
     return true;
 }
 
 
-/*! Flush in memory inode cache to disk. Needs to be called everytime inode field is updated. */
+/*! Flush in memory inode cache to disk. Needs to be called everytime inode field is updated.
+ *  The inode block is logged, so this needs to run inside a transaction.
+ *
+ *  The size on the disk only covers data that is on the disk: while
+ *  the inode has dirty pages it stays at `dsize`, which page writeback
+ *  moves up, see pcache.c. A crash never leaves a file that ends past
+ *  its written data.
+ * */
 void inode_flush(Inode *ino) {
     BNode   *b   = bcache_read(ino->dev, get_inode_block(ino->inum), false);
     offset_t nth = ino->inum % inode_per_block;
-    memmove(&b->cache[nth * sizeof(DInode)], &ino->d, sizeof(DInode));
-    bcache_write(b, false);
+    DInode  *di  = (DInode *)&b->cache[nth * sizeof(DInode)];
+    if (!ino->pdirty || ino->dsize > ino->d.size) // nothing unwritten past it
+        ino->dsize = ino->d.size;
+    memmove(di, &ino->d, sizeof(DInode));
+    di->size = ino->dsize;
+    log_write(b);
     bcache_release(b);
+    ino->mdirty = true;
 }
 
 
@@ -101,7 +207,7 @@ void inode_lock(Inode *ino) {
     if (!ino)           panic("inode_lock, invalid inode");
     if (ino->nref == 0) panic("inode_lock, inode is not used");
     lock_mutex(&ino->lk);
-    if (!inode_load(ino)) unlock_mutex(&ino->lk);
+    inode_load(ino);
 }
 
 
@@ -114,36 +220,276 @@ void inode_unlock(Inode *ino) {
 }
 
 
+/*! Get the raw block pointer of the nth block, flags included.
+ *  Doesn't allocate, return 0 for a hole.
+ * */
+blockno_t inode_bptr(Inode *ino, unsigned nth) {
+    if (nth < NDIRECT)
+        return ino->d.addrs[nth];
+
+    nth -= NDIRECT;
+    if (nth >= NINDIRECT1)
+        panic("inode_bptr: out of range");
+    if (ino->d.addrs[NDIRECT] == 0)
+        return 0;
+
+    BNode    *b = bcache_read(ino->dev, ino->d.addrs[NDIRECT], false);
+    blockno_t p = ((blockno_t *)b->cache)[nth];
+    bcache_release(b);
+    return p;
+}
+
+
+/*! Set the raw block pointer of the nth block. Allocate the indirect
+ *  block if necessary. Needs to run inside a transaction. Sets
+ *  `mdirty`, fdatasync has to commit a moved pointer.
+ *  Return false if the indirect block can't be allocated.
+ * */
+bool inode_setptr(Inode *ino, unsigned nth, blockno_t p) {
+    if (nth < NDIRECT) {
+        ino->d.addrs[nth] = p;
+        inode_flush(ino);
+        return true;
+    }
+
+    nth -= NDIRECT;
+    if (nth >= NINDIRECT1)
+        panic("inode_setptr: out of range");
+
+    if (ino->d.addrs[NDIRECT] == 0) { // singly indirect
+        blockno_t ptrsno;
+        if ((ptrsno = block_alloc(ino->dev)) == 0)
+            return false;
+        ino->d.addrs[NDIRECT] = ptrsno;
+        inode_flush(ino);
+    }
+
+    BNode *b = bcache_read(ino->dev, ino->d.addrs[NDIRECT], false);
+    ((blockno_t *)b->cache)[nth] = p;
+    log_write(b);
+    bcache_release(b);
+    ino->mdirty = true;
+    return true;
+}
+
+
 /* Return the blockno of the nth block of inode. Allocate blocks if necessary.
+ * Return 0 if the block can't be allocated.
  * */
 blockno_t inode_bmap(Inode *ino, unsigned nth) {
-    if (nth < NDIRECT) {
-        blockno_t blockno = 0;
-        if ((blockno = ino->d.addrs[nth]) == 0) {
-            blockno = block_alloc(ino->dev);
+    blockno_t blockno;
+
+    if ((blockno = inode_bptr(ino, nth)) != 0)
+        return BLK_ADDR(blockno);
+
+    if ((blockno = block_alloc(ino->dev)) == 0)
+        return 0;
+    if (!inode_setptr(ino, nth, blockno)) {
+        block_free(ino->dev, blockno);
+        return 0;
+    }
+    return blockno;
+}
+
+
+/*! Share all blocks of `src` with the empty file `dst`. Data blocks get
+ *  one more reference, only the indirect block is copied. Both inodes
+ *  need to be locked. Needs to run inside a transaction.
+ *  @return  0 on success, -1 if failed.
+ * */
+int inode_clone(Inode *dst, Inode *src) {
+    if (dst == src)                                     return -1;
+    if (dst->d.type != F_FILE || src->d.type != F_FILE) return -1;
+    if (dst->d.size != 0)                               return -1;
+    if ((dst->d.flags | src->d.flags) & I_COMPRESS)     return -1;
+    for (unsigned i = 0; i < NINOBLKS; ++i) {
+        if (dst->d.addrs[i]) return -1;
+    }
+    if (!pcache_flush(src)) // the clone shares what is on the disk
+        return -1;
+
+    for (unsigned nth = 0; nth < MAXFILE; ++nth) { // fail before any update
+        blockno_t p = inode_bptr(src, nth);
+        if (p && block_refcnt(src->dev, BLK_ADDR(p)) == 0xff)
+            return -1;
+    }
+
+    if (src->d.addrs[NDIRECT]) {
+        blockno_t ind;
+        if ((ind = block_alloc(dst->dev)) == 0)
+            return -1;
+        BNode     *from  = bcache_read(src->dev, src->d.addrs[NDIRECT], false);
+        BNode     *to    = bcache_read(dst->dev, ind, false);
+        blockno_t *fptrs = (blockno_t *)from->cache;
+        blockno_t *tptrs = (blockno_t *)to->cache;
+        for (unsigned i = 0; i < NINDIRECT1; ++i) {
+            if ((tptrs[i] = fptrs[i]) != 0)
+                block_ref(src->dev, BLK_ADDR(fptrs[i]));
         }
-        return blockno;
+        log_write(to);
+        bcache_release(from);
+        bcache_release(to);
+        dst->d.addrs[NDIRECT] = ind;
+    }
+
+    for (unsigned i = 0; i < NDIRECT; ++i) {
+        if ((dst->d.addrs[i] = src->d.addrs[i]) != 0)
+            block_ref(src->dev, BLK_ADDR(src->d.addrs[i]));
+    }
+
+    dst->d.size = src->d.size;
+    inode_flush(dst);
+    return 0;
+}
+
+
+/*! Turn compression of a locked empty file on or off, see pcache.c.
+ *  Needs to run inside a transaction.
+ *  @return  0 on success, -1 if failed.
+ * */
+int inode_setcomp(Inode *ino, bool on) {
+    if (ino->d.type != F_FILE) return -1;
+    if (ino->d.size != 0)      return -1;
+    for (unsigned i = 0; i < NINOBLKS; ++i) {
+        if (ino->d.addrs[i]) return -1;
+    }
+
+    if (on) ino->d.flags |= I_COMPRESS;
+    else    ino->d.flags &= ~I_COMPRESS;
+    inode_flush(ino);
+    return 0;
+}
+
+
+/*! Preallocate the blocks of [offset, offset + len). Missing blocks are
+ *  reserved in contiguous runs with `block_alloc_range` and marked
+ *  BLK_UNWRITTEN: they read as zeros and are not zeroed on the disk.
+ *  The file grows to cover the range, the bytes past the old end of its
+ *  last block are zeroed and written first. Needs to run inside a
+ *  transaction.
+ *  @return  0 on success, -1 if failed.
+ * */
+int inode_fallocate(Inode *ino, offset_t offset, unsigned len) {
+    if (ino->d.type != F_FILE)           return -1;
+    if (ino->d.flags & I_COMPRESS)       return -1;
+    if (len == 0)                        return -1;
+    if ((unsigned)(-1) - offset < len)   return -1;
+    if (offset + len > MAXFILE * BSIZE)  return -1;
+
+    if (offset + len > ino->d.size) { // the zeros are on the disk before the size
+        if (!pcache_zero_tail(ino, ino->d.size) || !pcache_flush(ino))
+            return -1;
     }
 
-    if (nth >= NDIRECT) { // singly indirect
-        blockno_t ptrsno  = 0;
-        offset_t  offset  = nth - NDIRECT;
-        blockno_t blockno = 0;
-        if ((ptrsno = ino->d.addrs[nth]) == 0) {
-            ptrsno = block_alloc(ino->dev);
+    unsigned last = (offset + len - 1) / BSIZE;
+    for (unsigned nth = offset / BSIZE; nth <= last;) {
+        if (inode_bptr(ino, nth)) {
+            nth++;
+            continue;
         }
-        BNode *blockptrs = bcache_read(ino->dev, ptrsno, false);
-        if ((blockno = ((unsigned *)blockptrs->cache)[offset]) == 0) {
-            blockno = block_alloc(ino->dev);
+
+        unsigned want = 1;
+        while (nth + want <= last && !inode_bptr(ino, nth + want))
+            want++;
+
+        blockno_t start;
+        unsigned  got;
+        if ((got = block_alloc_range(ino->dev, want, &start)) == 0)
+            return -1;
+        for (unsigned i = 0; i < got; ++i) {
+            if (!inode_setptr(ino, nth + i, (start + i) | BLK_UNWRITTEN)) {
+                for (; i < got; ++i)
+                    block_free(ino->dev, start + i);
+                return -1;
+            }
         }
-        bcache_release(blockptrs);
-        return blockno;
+        nth += got;
     }
 
+    if (offset + len > ino->d.size) {
+        ino->d.size = offset + len;
+        inode_flush(ino);
+    }
     return 0;
 }
 
 
+/*! Allocate a new inode of `type`. Needs to run inside a transaction.
+ *  @near    inum of the parent directory. A file is placed near it,
+ *           a directory is placed at the rotating cursor.
+ *  @return  the referenced inode, not locked. 0 if there is no free inode.
+ * */
+Inode *inode_allocate(devno_t dev, FileType type, inodeno_t near) {
+    inodeno_t inum;
+    bool      spread = type == F_DIR || near == 0;
+
+    if (dev != imap.dev)
+        panic("inode_allocate: unknown device");
+
+    lock(&imap.lk);
+    if (super_block.nifree == 0 || !imap_search(spread ? imap.cursor : near / 8, &inum)) {
+        unlock(&imap.lk);
+        return 0;
+    }
+    imap.bits[inum / 8] |= 0x80 >> (inum % 8); // reserve
+    super_block.nifree--;
+    if (spread)
+        imap.cursor = inum / 8;
+    unlock(&imap.lk);
+
+    Inode *ino;
+    if ((ino = inode_get(dev, inum)) == 0) {
+        lock(&imap.lk);
+        imap.bits[inum / 8] &= ~(0x80 >> (inum % 8));
+        super_block.nifree++;
+        unlock(&imap.lk);
+        return 0;
+    }
+
+    memset(&ino->d, 0, sizeof(DInode)); // before anything sleeps, see cleaner.c
+    ino->d.type = type;
+    ino->read   = true;
+    imap_set(inum, true);
+    block_super_sync(dev);
+    inode_flush(ino);
+    return ino;
+}
+
+
+/*! Return the inode number to the inode bitmap. Needs to run inside
+ *  a transaction. The disk inode is not touched.
+ * */
+void inode_free(devno_t dev, inodeno_t inum) {
+    if (dev != imap.dev)
+        panic("inode_free: unknown device");
+    if (inum == 0 || inum >= super_block.ninodes)
+        panic("inode_free: bad inum");
+    if (!(imap.bits[inum / 8] & (0x80 >> (inum % 8))))
+        panic("inode_free: inode is already free");
+
+    imap_set(inum, false);
+    lock(&imap.lk);
+    super_block.nifree++;
+    unlock(&imap.lk);
+    block_super_sync(dev);
+}
+
+
+/*! Is the inode number allocated? Reads the cached inode bitmap. */
+bool inode_used(devno_t dev, inodeno_t inum) {
+    bool used;
+    if (dev != imap.dev)
+        panic("inode_used: unknown device");
+    if (inum >= super_block.ninodes)
+        return false;
+
+    lock(&imap.lk);
+    used = imap.bits[inum / 8] & (0x80 >> (inum % 8));
+    unlock(&imap.lk);
+    return used;
+}
+
+
 /*! Increment the reference count for ino */
 Inode *inode_dup(Inode *ino) {
     ino->nref++;
@@ -152,12 +498,14 @@ Inode *inode_dup(Inode *ino) {
 
 
 /*! Drop reference count of an inode. If the reference count drops to 0 and
- * link count is 0, then `inode_drop` will free the disk space then
- * the ino is free to reuse.
- * TODO implement disk operation
+ * link count is 0, the inode is an orphan and the reaper frees its disk
+ * space in the background, see orphan.c. The reference held by dirty
+ * pages (pcache.c) doesn't count, the reaper drops the pages.
  * */
 void inode_drop(Inode *ino) {
-    ino->nref--;
+    int users = --ino->nref - (ino->pdirty != 0);
+    if (users == 0 && ino->read && ino->d.type && ino->d.nlink == 0)
+        orphan_kick();
 }
 
 
@@ -179,26 +527,33 @@ int inode_read(Inode *ino, char *buf, offset_t offset, unsigned sz) {
         if (ino->d.size < offset)         return -1;
         if ((unsigned)(-1) - offset < sz) return -1;
         if (offset + sz > ino->d.size) sz = ino->d.size - offset; // crops
+        if (ino->d.type == F_FILE)
+            return pcache_read(ino, buf, offset, sz);
         BNode *b;
         unsigned m;
         unsigned rd = 0; // bytes read
         while (rd < sz) {
-            unsigned  nth     = offset / BSIZE;
-            blockno_t blockno = inode_bmap(ino, nth);
-            b                 = bcache_read(ino->dev, blockno, false);
-            m                 = min(sz - rd, BSIZE - offset % BSIZE);
-            memmove(buf, &b->cache[offset % BSIZE], m);
+            blockno_t p = inode_bptr(ino, offset / BSIZE);
+            m           = min(sz - rd, BSIZE - offset % BSIZE);
+            if (p == 0 || (p & BLK_UNWRITTEN)) { // hole or preallocated
+                memset(buf, 0, m);
+            } else {
+                b = bcache_read(ino->dev, p, false);
+                memmove(buf, &b->cache[offset % BSIZE], m);
+                bcache_release(b);
+            }
             rd     += m;
             offset += m;
             buf    += m;
-            bcache_release(b);
         }
         return sz;
     }
 }
 
 
-/*! Write data to inode.
+/*! Write data to inode. Needs to run inside a transaction.
+ *  File data is write-back, it stays in the page cache until fsync or
+ *  until the page cache needs the page, see pcache.c.
  *  @ino    Inode
  *  @buf    the buffer write from
  *  @offest cursor offset, indicates n bytes from start of the file.
@@ -213,19 +568,22 @@ int inode_write(Inode *ino, const char *buf, offset_t offset, unsigned sz) {
         return devices[ino->d.major].write(ino, buf, sz);
     case F_DIR:
     case F_FILE:
-        if (ino->d.size < offset)         return -1;
-        if ((unsigned)(-1) - offset < sz) return -1;
-        if (offset + sz > MAXFILE)        return -1;
+        if (ino->d.size < offset)          return -1;
+        if ((unsigned)(-1) - offset < sz)  return -1;
+        if (offset + sz > MAXFILE * BSIZE) return -1;
+        if (ino->d.type == F_FILE)
+            return pcache_write(ino, buf, offset, sz);
         BNode *b;
         unsigned m;
         unsigned wt = 0;
-        while (wt < sz) {
-            unsigned  nth     = offset / BSIZE;
-            blockno_t blockno = inode_bmap(ino, nth);
-            b                 = bcache_read(ino->dev, blockno, false);
+        while (wt < sz) { // directory is metadata
+            blockno_t blockno = inode_bmap(ino, offset / BSIZE);
             m                 = min(sz - wt, BSIZE - offset % BSIZE);
+            if (blockno == 0)
+                break;
+            b = bcache_read(ino->dev, blockno, false);
             memmove(&b->cache[offset % BSIZE], buf, m);
-            bcache_write(b, false);
+            log_write(b);
             wt     += m;
             buf    += m;
             offset += m;
@@ -237,7 +595,7 @@ int inode_write(Inode *ino, const char *buf, offset_t offset, unsigned sz) {
             inode_flush(ino);
         }
 
-        return sz;
+        return wt;
     }
 }
 
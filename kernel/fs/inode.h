@@ -8,9 +8,16 @@
 
 void      inode_init();
 Inode    *inode_get(devno_t dev, inodeno_t inum);
-Inode    *inode_allocate(devno_t dev, FileType type);
+Inode    *inode_allocate(devno_t dev, FileType type, inodeno_t near);
+void      inode_free(devno_t dev, inodeno_t inum);
+bool      inode_used(devno_t dev, inodeno_t inum);
 void      inode_flush(Inode *ino);
+blockno_t inode_bptr(Inode *ino, unsigned nth);
+bool      inode_setptr(Inode *ino, unsigned nth, blockno_t p);
 blockno_t inode_bmap(Inode *ino, unsigned nth);
+int       inode_fallocate(Inode *ino, offset_t offset, unsigned len);
+int       inode_clone(Inode *dst, Inode *src);
+int       inode_setcomp(Inode *ino, bool on);
 Inode    *inode_dup(Inode *ino);
 bool      inode_load(Inode *ino);
 void      inode_lock(Inode *ino);
@@ -0,0 +1,360 @@
+#include "defs.h"
+#include "err.h"
+#include "string.h"
+#include "crc32c.h"
+#include "process.h"
+#include "process/spinlock.h"
+#include "fs/fdefs.h"
+#include "fs/bcache.h"
+#include "fs/block.h"
+#include "fs/log.h"
+#include "driver/vga.h"
+
+/* Write ahead log for metadata blocks.
+ *
+ * Updates to the bitmap, inode blocks and directory blocks are not
+ * written in place. A file system operation brackets its updates with
+ * `log_begin` and `log_end`, and uses `log_write` instead of
+ * `bcache_write` for metadata. `log_write` only records the block number
+ * and pins the bnode in the bcache, the block is written at commit:
+ *
+ *     1. copy every logged block to the log region and write the log
+ *        header, all in one pass without waiting in between
+ *     2. write the blocks to their home location (install)
+ *     3. clear the log header
+ *
+ * The header carries a CRC32C of itself and of the logged blocks. The
+ * disk may complete the writes of 1 in any order, so a crash in the
+ * middle can leave a header whose blocks never reached the log. The
+ * checksum catches that: `log_init` replays the log at mount only if the
+ * checksum matches, otherwise none of the updates of the transaction
+ * reaches the disk. Without it the header would need its own write
+ * after the log blocks are on the disk, doubling the commit latency.
+ *
+ * Group commit: a transaction is not committed when its last operation
+ * ends. It stays open and collects the operations that follow, a block
+ * updated by many of them is logged only once. The transaction commits
+ * when the log can't take another operation, when it has been open for
+ * LOGDELAY ticks (checked by the `logd` kernel thread), or when
+ * `log_flush` is called.
+ *
+ * File data blocks are not logged, they are written in place. Blocks
+ * freed by the transaction are released when it commits, see
+ * `block_free_pending`. Their freemap and superblock updates are logged
+ * at commit, `reserve` keeps room for them.
+ *
+ * On disk log region:
+ * [ header | block 1 | block 2 | ... | block NLOG ]
+ * */
+
+#define LOGDELAY 5 // max ticks a transaction stays open
+
+
+typedef struct LogHeader {
+    unsigned  n;
+    uint32_t  crc; // over n, blocks[0..n) and the n log blocks
+    blockno_t blocks[NLOG];
+} LogHeader;
+
+
+typedef struct Log {
+    SpinLock  lk;
+    devno_t   dev;
+    blockno_t start;       // block number of the log header
+    unsigned  size;        // number of log blocks, 0 if the fs has no log
+    unsigned  reserve;     // log blocks kept for the commit, see `commit`
+    unsigned  outstanding; // number of running operations
+    bool      committing;
+    bool      force;       // commit once outstanding drops to 0
+    unsigned  opened;      // ticks when the transaction logged its first block
+    LogHeader lh;
+} Log;
+
+
+Log               log;
+extern SuperBlock super_block;
+extern unsigned   ticks;
+
+
+/*! Copy committed blocks from the log to their home location.
+ *  When recovering, the blocks are read from the log region, otherwise
+ *  the pinned bnodes already hold the content and are unpinned after.
+ * */
+static void install_trans(bool recovering) {
+    for (unsigned i = 0; i < log.lh.n; ++i) {
+        BNode *dst = bcache_read(log.dev, log.lh.blocks[i], recovering);
+        if (recovering) {
+            BNode *src = bcache_read(log.dev, log.start + 1 + i, recovering);
+            memmove(dst->cache, src->cache, BSIZE);
+            bcache_release(src);
+        }
+        bcache_write(dst, recovering);
+        bcache_release(dst);
+        if (!recovering)
+            bcache_release(dst); // unpin
+    }
+}
+
+
+/*! Fold the header fields into the checksum of the log blocks */
+static uint32_t head_crc(uint32_t crc, const LogHeader *lh) {
+    crc = crc32c(crc, &lh->n, sizeof(lh->n));
+    return crc32c(crc, lh->blocks, lh->n * sizeof(blockno_t));
+}
+
+
+/*! Read the log header from the disk. A header with a bad size is
+ *  a torn write, it's read as an empty log.
+ * */
+static void read_head(bool poll) {
+    BNode     *b  = bcache_read(log.dev, log.start, poll);
+    LogHeader *lh = (LogHeader *)b->cache;
+    log.lh.n   = lh->n <= log.size ? lh->n : 0;
+    log.lh.crc = lh->crc;
+    for (unsigned i = 0; i < log.lh.n; ++i) {
+        log.lh.blocks[i] = lh->blocks[i];
+    }
+    bcache_release(b);
+}
+
+
+/*! Check the log region against the checksum in the header */
+static bool trans_valid(bool poll) {
+    uint32_t crc = 0;
+    for (unsigned i = 0; i < log.lh.n; ++i) {
+        BNode *b = bcache_read(log.dev, log.start + 1 + i, poll);
+        crc = crc32c(crc, b->cache, BSIZE);
+        bcache_release(b);
+    }
+    return head_crc(crc, &log.lh) == log.lh.crc;
+}
+
+
+/*! Write the in memory log header to the disk. Writing a header with
+ *  n > 0 commits the transaction.
+ * */
+static void write_head(bool poll) {
+    BNode     *b  = bcache_read(log.dev, log.start, poll);
+    LogHeader *lh = (LogHeader *)b->cache;
+    lh->n   = log.lh.n;
+    lh->crc = log.lh.crc;
+    for (unsigned i = 0; i < log.lh.n; ++i) {
+        lh->blocks[i] = log.lh.blocks[i];
+    }
+    bcache_write(b, poll);
+    bcache_release(b);
+}
+
+
+/*! Copy the logged blocks from the bcache to the log region and write
+ *  the checksummed header. All writes are queued to the disk at once,
+ *  the transaction is committed when they are all done.
+ * */
+static void write_trans() {
+    BNode   *to[NLOG + 1];
+    uint32_t crc = 0;
+
+    for (unsigned i = 0; i < log.lh.n; ++i) {
+        BNode *from = bcache_read(log.dev, log.lh.blocks[i], false);
+        to[i] = bcache_read(log.dev, log.start + 1 + i, false);
+        memmove(to[i]->cache, from->cache, BSIZE);
+        crc = crc32c(crc, to[i]->cache, BSIZE);
+        bcache_release(from);
+        bcache_write_async(to[i]);
+    }
+
+    log.lh.crc     = head_crc(crc, &log.lh);
+    BNode     *b   = bcache_read(log.dev, log.start, false);
+    LogHeader *lh  = (LogHeader *)b->cache;
+    lh->n          = log.lh.n;
+    lh->crc        = log.lh.crc;
+    for (unsigned i = 0; i < log.lh.n; ++i) {
+        lh->blocks[i] = log.lh.blocks[i];
+    }
+    bcache_write_async(b);
+    to[log.lh.n] = b;
+
+    for (unsigned i = 0; i <= log.lh.n; ++i) {
+        bcache_wait(to[i]);
+        bcache_release(to[i]);
+    }
+}
+
+
+/*! Commit the transaction. The blocks it freed are released first, as
+ *  part of it: nothing allocates until the commit is done, and a crash
+ *  before the header is written keeps them with their old owners.
+ * */
+static void commit() {
+    if (log.lh.n == 0)
+        return;
+    block_free_pending();
+    write_trans();
+    install_trans(false);
+    log.lh.n = 0;
+    write_head(false);
+}
+
+
+/*! Replay the committed transaction left in the log */
+static void recover() {
+    read_head(true);
+    if (log.lh.n > 0 && !trans_valid(true)) {
+        vga_printf("[\033[33mlog\033[0m] bad checksum, discard %d blocks\n", log.lh.n);
+        log.lh.n = 0;
+    }
+    install_trans(true);
+    log.lh.n   = 0;
+    log.lh.crc = 0;
+    write_head(true);
+}
+
+
+/*! Load the log of the file system and replay it if needed.
+ *  This runs before interrupts are enabled, so it polls the disk.
+ * */
+void log_init(devno_t dev) {
+    log.lk      = new_lock("log.lk");
+    log.dev     = dev;
+    log.start   = super_block.logstart;
+    log.size    = super_block.nlog;
+    log.reserve = super_block.datastart - super_block.bmapstart + 1; // freemap + super
+
+    if (log.size > NLOG)
+        panic("log_init: log too big");
+    if (log.size > 0 && NOPBLKS + log.reserve > log.size)
+        panic("log_init: log too small");
+    if (sizeof(LogHeader) > BSIZE)
+        panic("log_init: log header too big");
+    if (log.size == 0)
+        return;
+
+    crc32c_init();
+    recover();
+}
+
+
+/*! Should the transaction commit now? Called with log.lk held. */
+static bool should_commit() {
+    if (log.outstanding > 0) return false;
+    if (log.lh.n == 0)       return false;
+    return log.force
+        || log.lh.n + NOPBLKS + log.reserve > log.size
+        || ticks - log.opened >= LOGDELAY;
+}
+
+
+/*! Commit the transaction. Called with log.lk held, the lock is released
+ *  during the disk IO.
+ * */
+static void do_commit() {
+    log.committing = true;
+    unlock(&log.lk);
+    commit();
+    lock(&log.lk);
+    log.committing = false;
+    log.force      = false;
+    wakeup(&log);
+}
+
+
+/*! Start a file system operation. An operation writes at most NOPBLKS
+ *  blocks. Waits if the log is committing or doesn't have enough space.
+ * */
+void log_begin() {
+    lock(&log.lk);
+    for (;;) {
+        if (log.committing) {
+            sleep(&log, &log.lk);
+        } else if (log.size > 0
+                   && log.lh.n + (log.outstanding + 1) * NOPBLKS + log.reserve > log.size) {
+            sleep(&log, &log.lk);
+        } else {
+            log.outstanding++;
+            break;
+        }
+    }
+    unlock(&log.lk);
+}
+
+
+/*! End a file system operation. Commits if the transaction is full, old
+ *  or forced and this was the last running operation.
+ * */
+void log_end() {
+    lock(&log.lk);
+    if (log.outstanding == 0)
+        panic("log_end: no operation");
+    if (log.committing)
+        panic("log_end: committing");
+
+    log.outstanding--;
+    if (should_commit())
+        do_commit();
+    else
+        wakeup(&log); // log_begin may be waiting for space.
+    unlock(&log.lk);
+}
+
+
+/*! Record the update of a metadata block. Use it in place of
+ *  `bcache_write`. The bnode is pinned in the bcache until the
+ *  transaction is installed. Runs inside an operation, or in `commit`
+ *  for the released blocks.
+ * */
+void log_write(BNode *b) {
+    if (log.size == 0) {
+        bcache_write(b, false);
+        return;
+    }
+
+    lock(&log.lk);
+    if (log.outstanding < 1 && !log.committing)
+        panic("log_write: outside of transaction");
+
+    unsigned i;
+    for (i = 0; i < log.lh.n; ++i) {
+        if (log.lh.blocks[i] == b->blockno) // absorption
+            break;
+    }
+
+    if (i == log.lh.n) {
+        if (log.lh.n >= log.size)
+            panic("log_write: transaction too big");
+        if (log.lh.n == 0)
+            log.opened = ticks;
+        log.lh.blocks[log.lh.n++] = b->blockno;
+        b->nref++; // pin
+    }
+    unlock(&log.lk);
+}
+
+
+/*! Commit the open transaction and wait until it's on the disk */
+void log_flush() {
+    lock(&log.lk);
+    while (log.committing)
+        sleep(&log, &log.lk);
+
+    if (log.lh.n > 0) {
+        log.force = true;
+        if (log.outstanding == 0)
+            do_commit();
+        while (log.force)
+            sleep(&log, &log.lk);
+    }
+    unlock(&log.lk);
+}
+
+
+/*! Kernel thread that commits transactions left open after LOGDELAY
+ *  ticks, so a quiet file system doesn't keep updates in memory.
+ * */
+void log_daemon() {
+    lock(&log.lk);
+    for (;;) {
+        sleep(&ticks, &log.lk);
+        if (!log.committing && should_commit())
+            do_commit();
+    }
+}
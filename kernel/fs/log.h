@@ -0,0 +1,11 @@
+#pragma once
+#include "fdefs.fwd.h"
+#include "fs/fdefs.h"
+
+
+void log_init(devno_t dev);
+void log_begin();
+void log_end();
+void log_write(BNode *b);
+void log_flush();
+void log_daemon();
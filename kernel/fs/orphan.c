@@ -0,0 +1,258 @@
+#include "defs.h"
+#include "err.h"
+#include "stdlib.h"
+#include "string.h"
+#include "process.h"
+#include "process/spinlock.h"
+#include "fs/fdefs.h"
+#include "fs/bcache.h"
+#include "fs/block.h"
+#include "fs/pcache.h"
+#include "fs/inode.h"
+#include "fs/log.h"
+#include "fs/orphan.h"
+
+/* Orphan list and background block reclaim.
+ *
+ * An orphan is an inode whose blocks need to be freed: a file whose
+ * last link was removed, or a shadow inode holding the blocks cut off
+ * by a truncate. Orphans are chained on disk through `DInode.orphan`,
+ * starting at `super_block.orphan`, so a crash never leaks their blocks:
+ * the list is still there at the next mount.
+ *
+ * Freeing is done by the `reaper` kernel thread. It frees NREAP blocks
+ * per transaction, the blocks of a batch are sorted and each freemap
+ * block is updated once. unlink and truncate only move block pointers
+ * and return, no matter how big the file is.
+ *
+ * An unlinked file that is still open stays on the list until its last
+ * reference is dropped, `inode_drop` kicks the reaper then.
+ * */
+
+#define NREAP 64 // max blocks freed per transaction
+
+
+typedef struct Orphans {
+    SpinLock lk;
+    devno_t  dev;
+    bool     pending; // the list may have work for the reaper
+} Orphans;
+
+
+Orphans           orphans;
+extern SuperBlock super_block;
+
+
+/*! Reap the orphans left by the previous mount */
+void orphan_init(devno_t dev) {
+    orphans.lk      = new_lock("orphans.lk");
+    orphans.dev     = dev;
+    orphans.pending = super_block.orphan != 0;
+}
+
+
+/*! Put a locked inode on the orphan list. Needs to run inside a
+ *  transaction. The reaper is kicked when the inode is dropped.
+ * */
+void orphan_add(Inode *ino) {
+    lock(&orphans.lk);
+    ino->d.orphan      = super_block.orphan;
+    super_block.orphan = ino->inum;
+    unlock(&orphans.lk);
+    inode_flush(ino);
+    block_super_sync(ino->dev);
+}
+
+
+/*! Remove a locked inode from the orphan list. Needs to run inside a
+ *  transaction.
+ * */
+static void orphan_remove(Inode *ino) {
+    if (super_block.orphan == ino->inum) {
+        super_block.orphan = ino->d.orphan;
+        block_super_sync(ino->dev);
+    } else {
+        inodeno_t inum = super_block.orphan;
+        while (inum) {
+            Inode *prev;
+            if ((prev = inode_get(ino->dev, inum)) == 0)
+                panic("orphan_remove: no inode");
+            inode_lock(prev);
+            inum = prev->d.orphan;
+            if (inum == ino->inum) {
+                prev->d.orphan = ino->d.orphan;
+                inode_flush(prev);
+                inum = 0;
+            }
+            inode_unlock(prev);
+            inode_drop(prev);
+        }
+    }
+    ino->d.orphan = 0;
+    inode_flush(ino);
+}
+
+
+/*! Tell the reaper there may be work */
+void orphan_kick() {
+    lock(&orphans.lk);
+    orphans.pending = true;
+    wakeup(&orphans);
+    unlock(&orphans.lk);
+}
+
+
+/*! Detach up to `max` blocks from the end of a locked inode.
+ *  The cleared pointers are logged, so a crash never frees a block twice.
+ *  @return  number of blocks stored in `out`.
+ * */
+static unsigned reap_blocks(Inode *ino, blockno_t *out, unsigned max) {
+    unsigned n = 0;
+
+    if (ino->d.addrs[NDIRECT]) {
+        BNode     *b    = bcache_read(ino->dev, ino->d.addrs[NDIRECT], false);
+        blockno_t *ptrs = (blockno_t *)b->cache;
+        int        i    = NINDIRECT1 - 1;
+        for (; i >= 0 && n < max; --i) {
+            if (ptrs[i]) {
+                out[n++] = BLK_ADDR(ptrs[i]);
+                ptrs[i]  = 0;
+            }
+        }
+        if (n > 0)
+            log_write(b);
+        bcache_release(b);
+
+        if (i >= 0 || n == max)
+            return n;
+        out[n++] = ino->d.addrs[NDIRECT];
+        ino->d.addrs[NDIRECT] = 0;
+    }
+
+    for (int i = NDIRECT - 1; i >= 0 && n < max; --i) {
+        if (ino->d.addrs[i]) {
+            out[n++]        = BLK_ADDR(ino->d.addrs[i]);
+            ino->d.addrs[i] = 0;
+        }
+    }
+    return n;
+}
+
+
+/*! Free every block of a locked orphan, then take it off the list.
+ *  The inode itself is freed if it has no link left.
+ * */
+static void reap(Inode *ino) {
+    blockno_t batch[NREAP];
+    unsigned  n;
+
+    pcache_truncate(ino, 0);
+    do {
+        log_begin();
+        if ((n = reap_blocks(ino, batch, NREAP)) > 0) {
+            block_free_batch(ino->dev, batch, n);
+            ino->d.size = 0;
+            inode_flush(ino);
+        } else {
+            orphan_remove(ino);
+            if (ino->d.nlink == 0) {
+                memset(&ino->d, 0, sizeof(DInode));
+                inode_flush(ino);
+                inode_free(ino->dev, ino->inum);
+            }
+        }
+        log_end();
+    } while (n > 0);
+}
+
+
+/*! Cut a locked file down to `size` bytes. The blocks past the new end
+ *  are moved to a new shadow inode that is put on the orphan list, the
+ *  reaper frees them later. Only shrinking is supported. Needs to run
+ *  inside a transaction.
+ *  @return  0 on success, -1 if failed.
+ * */
+int orphan_truncate(Inode *ino, offset_t size) {
+    if (ino->d.type != F_FILE) return -1;
+    if (size > ino->d.size)    return -1;
+
+    unsigned keep = (size + BSIZE - 1) / BSIZE; // blocks kept
+    Inode   *shadow;
+
+    if (ino->d.flags & I_COMPRESS) // keep whole pages
+        keep = min(MAXFILE, (keep + PGBLKS - 1) / PGBLKS * PGBLKS);
+
+    if (!pcache_zero_tail(ino, size)) // the cut bytes are not read again
+        return -1;
+    if ((shadow = inode_allocate(ino->dev, F_FILE, ino->inum)) == 0)
+        return -1;
+    inode_lock(shadow);
+
+    if (keep > NDIRECT && ino->d.addrs[NDIRECT]) { // split the indirect block
+        blockno_t ind;
+        if ((ind = block_alloc(ino->dev)) == 0) {
+            memset(&shadow->d, 0, sizeof(DInode));
+            inode_flush(shadow);
+            inode_free(shadow->dev, shadow->inum);
+            inode_unlock(shadow);
+            inode_drop(shadow);
+            return -1;
+        }
+        BNode     *from  = bcache_read(ino->dev, ino->d.addrs[NDIRECT], false);
+        BNode     *to    = bcache_read(ino->dev, ind, false);
+        blockno_t *fptrs = (blockno_t *)from->cache;
+        blockno_t *tptrs = (blockno_t *)to->cache;
+        for (unsigned i = keep - NDIRECT; i < NINDIRECT1; ++i) {
+            tptrs[i] = fptrs[i];
+            fptrs[i] = 0;
+        }
+        log_write(from);
+        log_write(to);
+        bcache_release(from);
+        bcache_release(to);
+        shadow->d.addrs[NDIRECT] = ind;
+    } else if (keep <= NDIRECT) {
+        shadow->d.addrs[NDIRECT] = ino->d.addrs[NDIRECT];
+        ino->d.addrs[NDIRECT]    = 0;
+    }
+
+    for (unsigned i = keep; i < NDIRECT; ++i) {
+        shadow->d.addrs[i] = ino->d.addrs[i];
+        ino->d.addrs[i]    = 0;
+    }
+
+    pcache_truncate(ino, size);
+    ino->d.size = size;
+    inode_flush(ino);
+    orphan_add(shadow);
+    inode_unlock(shadow);
+    inode_drop(shadow);
+    return 0;
+}
+
+
+/*! Kernel thread that frees the blocks of orphans. Orphans still in use
+ *  are skipped, they are reaped after their last `inode_drop`.
+ * */
+void orphan_daemon() {
+    for (;;) {
+        lock(&orphans.lk);
+        while (!orphans.pending)
+            sleep(&orphans, &orphans.lk);
+        orphans.pending = false;
+        unlock(&orphans.lk);
+
+        inodeno_t inum = super_block.orphan;
+        while (inum) {
+            Inode *ino;
+            if ((ino = inode_get(orphans.dev, inum)) == 0)
+                break; // icache is full, wait for the next kick
+            inode_lock(ino);
+            inum = ino->d.orphan;
+            if (ino->nref - (ino->pdirty != 0) == 1) // dirty pages are dropped
+                reap(ino);
+            inode_unlock(ino);
+            inode_drop(ino);
+        }
+    }
+}
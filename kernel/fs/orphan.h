@@ -0,0 +1,10 @@
+#pragma once
+#include "fdefs.fwd.h"
+#include "fs/fdefs.h"
+
+
+void orphan_init(devno_t dev);
+void orphan_add(Inode *ino);
+void orphan_kick();
+int  orphan_truncate(Inode *ino, offset_t size);
+void orphan_daemon();
@@ -0,0 +1,708 @@
+#include "defs.h"
+#include "err.h"
+#include "i386.h"
+#include "lz4.h"
+#include "stdlib.h"
+#include "string.h"
+#include "memory/palloc.h"
+#include "process.h"
+#include "process/mutex.h"
+#include "process/spinlock.h"
+#include "fs/fdefs.h"
+#include "fs/bcache.h"
+#include "fs/block.h"
+#include "fs/inode.h"
+#include "fs/log.h"
+#include "fs/pcache.h"
+
+/* Page cache.
+ *
+ * File data is cached in pages of PAGE_SZ bytes keyed on (dev, inum,
+ * page index), so a cache hit never looks at a block pointer. The bcache
+ * only caches metadata, it carries file data to and from the disk, see
+ * `bcache_forget`. The blocks of a page are read in one batch.
+ *
+ * A write only updates the page and marks its blocks dirty. The dirty
+ * pages of an inode are on `Inode.pdirty`, the first one takes a
+ * reference to the inode so it stays cached. They are written back:
+ *
+ *     - at fsync and sync
+ *     - when the inode has more than NPDIRTY of them, by its writer
+ *     - when the writer needs a page and every clean page is taken
+ *     - after FLUSHDELAY ticks, or when the cache holds more than
+ *       NDIRTYMAX dirty pages, by the `flushd` kernel thread
+ * Block pointers
+ * are resolved at writeback, which runs inside a transaction:
+ *
+ *     - a hole gets a new block
+ *     - a block shared with a clone gets a new block, see `block_ref`
+ *     - an unwritten block is written and loses BLK_UNWRITTEN
+ *     - on SB_LFS every dirty block moves to the head segment, see block.c
+ *
+ * The data reaches the disk before the new pointers are committed, and
+ * before the size that covers it: the size on the disk only moves past
+ * the pages written back in file order, see `inode_flush`.
+ *
+ * Compressed files (I_COMPRESS) are compressed page by page with LZ4
+ * (lib/lz4.c). If that saves at least one block, the result is stored
+ * in the first k block pointers of the page and the others are 0:
+ *
+ *     [ CHeader | lz4 data ... ] in k blocks, first pointer has BLK_COMPRESSED
+ *
+ * otherwise the page is stored raw. A compressed page is always written
+ * whole, at new blocks. The codec cost in cycles is kept with the byte
+ * counts and reported by `statfs`.
+ *
+ * Pages get their memory from palloc on first use and keep it. They are
+ * chained in NPCHASH hash buckets and linked in a circular LRU list,
+ * `head` is the most recently used page. A page mapped into user space
+ * (mmap) is pinned by `nref` and is not recycled until it's unmapped.
+ * */
+
+#define NPCHASH    64             // number of hash buckets
+#define NDIRTYMAX  (NPCACHE / 4)  // dirty pages in the cache before flushd writes back
+#define FLUSHDELAY 50             // max ticks a page stays dirty
+
+
+typedef struct CHeader {
+    uint16_t clen;   // size of the lz4 data
+    uint16_t rawlen; // size of the page data before compression
+} CHeader;
+
+
+typedef struct PCache {
+    Mutex    mtx;     // also guards zbuf and ht
+    SpinLock flushlk; // guards kick, for flushd to sleep on
+    bool     kick;    // flushd writes back every dirty page
+    unsigned ndirty;  // dirty pages of all inodes
+    Page    *head;
+    Page    *hash[NPCHASH];
+    Page     pages[NPCACHE];
+    StatFs   stats;   // only the z* fields are used
+} PCache;
+
+
+PCache            pcache;
+extern SuperBlock super_block;
+extern unsigned   ticks;
+static char       zbuf[PAGE_SZ];  // compressed page
+static uint16_t   ht[LZ4_HTSIZE]; // compressor hash table
+
+
+void pcache_init() {
+    pcache.mtx     = new_mutex("pcache.mtx");
+    pcache.flushlk = new_lock("pcache.flushlk");
+
+    for (int i = 0; i < NPCACHE; ++i) {
+        Page *pg = &pcache.pages[i];
+        pg->next = &pcache.pages[(i + 1) % NPCACHE];
+        pg->prev = &pcache.pages[(i + NPCACHE - 1) % NPCACHE];
+        pg->inum = 0;
+        pg->data = 0;
+    }
+    pcache.head = &pcache.pages[0];
+}
+
+
+static unsigned pcache_bucket(devno_t dev, inodeno_t inum, unsigned idx) {
+    return ((inum * 2654435761u) ^ (idx * 40503u) ^ dev) % NPCHASH;
+}
+
+
+/*! Find the page `idx` of the inode. Return 0 if not cached. */
+static Page *pcache_find(devno_t dev, inodeno_t inum, unsigned idx) {
+    Page *pg = pcache.hash[pcache_bucket(dev, inum, idx)];
+    for (; pg; pg = pg->hnext) {
+        if (pg->inum == inum && pg->dev == dev && pg->idx == idx)
+            return pg;
+    }
+    return 0;
+}
+
+
+/*! Remove the page from its hash chain, it's unused after */
+static void pcache_unhash(Page *pg) {
+    Page **pp = &pcache.hash[pcache_bucket(pg->dev, pg->inum, pg->idx)];
+    for (; *pp; pp = &(*pp)->hnext) {
+        if (*pp == pg) {
+            *pp = pg->hnext;
+            break;
+        }
+    }
+    pg->hnext = 0;
+    pg->inum  = 0;
+}
+
+
+/*! Move the page to the head of the LRU list */
+static void pcache_touch(Page *pg) {
+    if (pg == pcache.head)
+        return;
+
+    pg->prev->next          = pg->next;
+    pg->next->prev          = pg->prev;
+    pg->next                = pcache.head;
+    pg->prev                = pcache.head->prev;
+    pcache.head->prev->next = pg;
+    pcache.head->prev       = pg;
+    pcache.head             = pg;
+}
+
+
+/*! Number of blocks of page `idx`, the last page of a max size file is
+ *  shorter.
+ * */
+static unsigned page_blks(unsigned idx) {
+    return min(PGBLKS, MAXFILE - idx * PGBLKS);
+}
+
+
+/*! Bytes of page `idx` inside the file */
+static unsigned page_len(Inode *ino, unsigned idx) {
+    unsigned start = idx * PAGE_SZ;
+    return ino->d.size > start ? min(PAGE_SZ, ino->d.size - start) : 0;
+}
+
+
+/*! Read a compressed page. Called with `p` the first pointer.
+ *  @return  false if the page is corrupted.
+ * */
+static bool page_fill_z(Page *pg, Inode *ino, blockno_t p) {
+    unsigned first = pg->idx * PGBLKS;
+    unsigned nblks = page_blks(pg->idx);
+    CHeader *h     = (CHeader *)zbuf;
+    unsigned len   = BSIZE;
+
+    for (unsigned i = 0; i < len; i += BSIZE) {
+        if (i > 0) p = inode_bptr(ino, first + i / BSIZE);
+        if (BLK_ADDR(p) == 0)
+            return false;
+        BNode *b = bcache_read(ino->dev, BLK_ADDR(p), false);
+        memmove(&zbuf[i], b->cache, BSIZE);
+        bcache_forget(b);
+
+        if (i == 0) {
+            if (h->rawlen > PAGE_SZ || sizeof(CHeader) + h->clen > (nblks - 1) * BSIZE)
+                return false;
+            len = sizeof(CHeader) + h->clen;
+        }
+    }
+
+    uint64_t t = rdtsc();
+    int      r = lz4_decompress(&zbuf[sizeof(CHeader)], h->clen, pg->data, PAGE_SZ);
+    pcache.stats.dcycles += rdtsc() - t;
+    if (r != h->rawlen)
+        return false;
+    memset(&pg->data[r], 0, PAGE_SZ - r);
+    return true;
+}
+
+
+/*! Read page `pg->idx` of a locked inode into `pg->data`. Holes and
+ *  unwritten blocks read as zeros.
+ *  @return  false if a compressed page is corrupted.
+ * */
+static bool page_fill(Page *pg, Inode *ino) {
+    unsigned  first = pg->idx * PGBLKS;
+    unsigned  nblks = page_blks(pg->idx);
+    blockno_t p     = inode_bptr(ino, first);
+    blockno_t bnos[PGBLKS];
+    unsigned  at[PGBLKS];
+    BNode    *bs[PGBLKS];
+    unsigned  n = 0;
+
+    if (p & BLK_COMPRESSED)
+        return page_fill_z(pg, ino, p);
+
+    memset(pg->data, 0, PAGE_SZ);
+    for (unsigned i = 0; i < nblks; ++i) {
+        if (i > 0) p = inode_bptr(ino, first + i);
+        if (p == 0 || (p & BLK_UNWRITTEN))
+            continue;
+        at[n]     = i;
+        bnos[n++] = BLK_ADDR(p);
+    }
+
+    bcache_read_batch(ino->dev, bnos, n, bs);
+    for (unsigned i = 0; i < n; ++i) {
+        memmove(&pg->data[at[i] * BSIZE], bs[i]->cache, BSIZE);
+        bcache_forget(bs[i]);
+    }
+    return true;
+}
+
+
+/*! Mark blocks of the page dirty for `ino` */
+static void page_dirty(Page *pg, Inode *ino, unsigned mask) {
+    if (!pg->owner) {
+        if (ino->npdirty++ == 0)
+            inode_dup(ino); // dropped with the last dirty page
+        pg->owner   = ino;
+        pg->dnext   = ino->pdirty;
+        pg->dirtied = ticks;
+        ino->pdirty = pg;
+        pcache.ndirty++;
+    }
+    pg->dmask |= mask;
+}
+
+
+/*! Take the page off the dirty list of its owner */
+static void page_clean(Page *pg) {
+    Inode *ino = pg->owner;
+    if (!ino)
+        return;
+
+    Page **pp = &ino->pdirty;
+    for (; *pp != pg; pp = &(*pp)->dnext);
+    *pp       = pg->dnext;
+    pg->dnext = 0;
+    pg->owner = 0;
+    pg->dmask = 0;
+    pcache.ndirty--;
+    if (--ino->npdirty == 0)
+        inode_drop(ino);
+}
+
+
+/*! Allocate `k` blocks in as few runs as the allocator gives. Needs to
+ *  run inside a transaction.
+ *  @return  false if the disk is full, nothing is allocated then.
+ * */
+static bool alloc_blocks(devno_t dev, blockno_t *out, unsigned k) {
+    for (unsigned i = 0; i < k;) {
+        blockno_t start;
+        unsigned  got;
+        if ((got = block_alloc_range(dev, k - i, &start)) == 0) {
+            while (i > 0)
+                block_free(dev, out[--i]);
+            return false;
+        }
+        for (unsigned j = 0; j < got; ++j)
+            out[i++] = start + j;
+    }
+    return true;
+}
+
+
+/*! Allocate the indirect block the page needs before any block of the
+ *  page moves, so setting its pointers can't fail halfway.
+ * */
+static bool page_ptrs_ready(Inode *ino, unsigned idx) {
+    unsigned last = idx * PGBLKS + page_blks(idx) - 1;
+    return last < NDIRECT || inode_setptr(ino, last, inode_bptr(ino, last));
+}
+
+
+/*! Write `len` bytes of `src` to the blocks `bnos` in one batch */
+static void write_blocks(devno_t dev, const blockno_t *bnos, const char *src, unsigned len) {
+    BNode   *bs[PGBLKS];
+    unsigned n = 0;
+    for (unsigned off = 0; off < len; off += BSIZE, ++n) {
+        bs[n] = bcache_get(dev, bnos[n]);
+        memmove(bs[n]->cache, &src[off], min(BSIZE, len - off));
+    }
+    bcache_write_batch(bs, n);
+}
+
+
+/*! Write back a page of a compressed file, the whole page moves to new
+ *  blocks and the old ones are freed, for reuse once the transaction
+ *  commits.
+ * */
+static bool page_writeback_z(Page *pg, Inode *ino, unsigned raw) {
+    unsigned first = pg->idx * PGBLKS;
+    unsigned nblks = page_blks(pg->idx);
+    unsigned rawk  = (raw + BSIZE - 1) / BSIZE;
+
+    uint64_t t    = rdtsc();
+    int      clen = lz4_compress(pg->data, raw, &zbuf[sizeof(CHeader)],
+                                 (nblks - 1) * BSIZE - sizeof(CHeader), ht);
+    pcache.stats.zcycles += rdtsc() - t;
+
+    const char *src = pg->data;
+    unsigned    len = raw;
+    if (clen > 0 && (sizeof(CHeader) + clen + BSIZE - 1) / BSIZE < rawk) {
+        CHeader *h = (CHeader *)zbuf;
+        h->clen    = clen;
+        h->rawlen  = raw;
+        src        = zbuf;
+        len        = sizeof(CHeader) + clen;
+    }
+
+    blockno_t nbs[PGBLKS];
+    unsigned  k = (len + BSIZE - 1) / BSIZE;
+    if (!page_ptrs_ready(ino, pg->idx) || !alloc_blocks(ino->dev, nbs, k))
+        return false;
+    write_blocks(ino->dev, nbs, src, len);
+
+    for (unsigned i = 0; i < nblks; ++i) {
+        blockno_t p = inode_bptr(ino, first + i);
+        if (p)
+            block_free(ino->dev, BLK_ADDR(p));
+        p = i < k ? nbs[i] : 0;
+        if (i == 0 && k > 0 && src == zbuf)
+            p |= BLK_COMPRESSED;
+        inode_setptr(ino, first + i, p);
+    }
+    pcache.stats.zin  += raw;
+    pcache.stats.zout += len;
+    return true;
+}
+
+
+/*! Write back the dirty blocks of a page. A block without its own place
+ *  on the disk gets a new one, see the top of the file.
+ * */
+static bool page_writeback_raw(Page *pg, Inode *ino, unsigned raw) {
+    unsigned  first = pg->idx * PGBLKS;
+    unsigned  nblks = (raw + BSIZE - 1) / BSIZE;
+    bool      lfs   = super_block.flags & SB_LFS;
+    blockno_t ptrs[PGBLKS], nbs[PGBLKS], to[PGBLKS];
+    unsigned  fresh = 0, k = 0;
+
+    for (unsigned i = 0; i < nblks; ++i) {
+        if (!(pg->dmask & (1 << i)))
+            continue;
+        blockno_t p = ptrs[i] = inode_bptr(ino, first + i);
+        if (p == 0 || (!(p & BLK_UNWRITTEN) && (lfs || block_refcnt(ino->dev, BLK_ADDR(p)) > 0))) {
+            fresh |= 1 << i;
+            k++;
+        }
+    }
+    if (!page_ptrs_ready(ino, pg->idx) || !alloc_blocks(ino->dev, nbs, k))
+        return false;
+
+    BNode   *bs[PGBLKS];
+    unsigned n = 0;
+    k = 0;
+    for (unsigned i = 0; i < nblks; ++i) {
+        if (!(pg->dmask & (1 << i)))
+            continue;
+        to[i] = fresh & (1 << i) ? nbs[k++] : BLK_ADDR(ptrs[i]);
+        bs[n] = bcache_get(ino->dev, to[i]);
+        memmove(bs[n++]->cache, &pg->data[i * BSIZE], BSIZE);
+    }
+    bcache_write_batch(bs, n);
+
+    for (unsigned i = 0; i < nblks; ++i) {
+        if (!(pg->dmask & (1 << i)) || ptrs[i] == to[i])
+            continue;
+        inode_setptr(ino, first + i, to[i]);
+        if (fresh & (1 << i) && ptrs[i])
+            block_free(ino->dev, BLK_ADDR(ptrs[i]));
+    }
+    return true;
+}
+
+
+/*! Write back a dirty page of a locked inode, the first `pg->len`
+ *  bytes of it. Needs to run inside a transaction.
+ *  @return  false if the disk is full, the page stays dirty.
+ * */
+static bool page_writeback(Page *pg, Inode *ino) {
+    unsigned raw = pg->len;
+    bool     ok;
+
+    if (ino->d.flags & I_COMPRESS)
+        ok = page_writeback_z(pg, ino, raw);
+    else
+        ok = page_writeback_raw(pg, ino, raw);
+    if (ok)
+        page_clean(pg);
+    return ok;
+}
+
+
+/*! Has a writer of the inode to write back before it goes on? Over
+ *  NDIRTYMAX dirty pages in the cache, flushd writes them all back.
+ *  Called with pcache.mtx held.
+ * */
+static bool too_dirty(Inode *ino) {
+    if (pcache.ndirty > NDIRTYMAX) {
+        lock(&pcache.flushlk);
+        pcache.kick = true;
+        unlock(&pcache.flushlk);
+    }
+    return ino->npdirty > NPDIRTY;
+}
+
+
+/*! Write back the dirty pages of a locked inode in file order. Called
+ *  with pcache.mtx held, inside a transaction.
+ * */
+static bool pcache_writeback(Inode *ino) {
+    while (ino->pdirty) {
+        Page *first = ino->pdirty;
+        for (Page *pg = first->dnext; pg; pg = pg->dnext) {
+            if (pg->idx < first->idx)
+                first = pg;
+        }
+        offset_t end = (first->idx + 1) * PAGE_SZ;
+        if (!page_writeback(first, ino))
+            return false;
+        if (ino->dsize < ino->d.size && ino->dsize < end) { // data up to `end` is written
+            ino->dsize = min(end, ino->d.size);
+            inode_flush(ino);
+        }
+    }
+    return true;
+}
+
+
+/*! Find page `idx` of a locked inode, read it on a miss. Called with
+ *  pcache.mtx held.
+ *  @own     inside a transaction, the dirty pages of the inode can be
+ *           written back to make room.
+ *  @return  0 if there is no page to recycle or the page is corrupted.
+ * */
+static Page *pcache_get(Inode *ino, unsigned idx, bool own) {
+    Page *pg;
+    if ((pg = pcache_find(ino->dev, ino->inum, idx)) != 0) {
+        pcache_touch(pg);
+        return pg;
+    }
+
+    for (;;) {
+        for (pg = pcache.head->prev; pg->owner || pg->nref > 0; pg = pg->prev) {
+            if (pg == pcache.head) { // least recently used clean one
+                pg = 0;
+                break;
+            }
+        }
+        if (pg || !own || !ino->pdirty)
+            break;
+        if (!pcache_writeback(ino))
+            return 0;
+    }
+    if (!pg)
+        return 0;
+    if (!pg->data && (pg->data = palloc()) == 0)
+        return 0;
+
+    if (pg->inum)
+        pcache_unhash(pg);
+    pg->dev   = ino->dev;
+    pg->inum  = ino->inum;
+    pg->idx   = idx;
+    if (!page_fill(pg, ino)) {
+        pg->inum = 0;
+        return 0;
+    }
+    pg->len = page_len(ino, idx);
+
+    unsigned h     = pcache_bucket(pg->dev, pg->inum, idx);
+    pg->hnext      = pcache.hash[h];
+    pcache.hash[h] = pg;
+    pcache_touch(pg);
+    return pg;
+}
+
+
+/*! Read from a locked file, the range is checked by the caller.
+ *  @return  number of bytes read, -1 if failed.
+ * */
+int pcache_read(Inode *ino, char *buf, offset_t offset, unsigned sz) {
+    unsigned rd = 0;
+    lock_mutex(&pcache.mtx);
+    while (rd < sz) {
+        Page *pg;
+        if ((pg = pcache_get(ino, offset / PAGE_SZ, false)) == 0)
+            break;
+        unsigned m = min(sz - rd, PAGE_SZ - offset % PAGE_SZ);
+        memmove(buf, &pg->data[offset % PAGE_SZ], m);
+        rd     += m;
+        offset += m;
+        buf    += m;
+    }
+    unlock_mutex(&pcache.mtx);
+    return rd > 0 || sz == 0 ? (int)rd : -1;
+}
+
+
+/*! Write to a locked file, the range is checked by the caller. Only the
+ *  pages are updated, the file grows as they are. The new size reaches
+ *  the disk with the written pages. Needs to run inside a transaction.
+ *  @return  number of bytes written.
+ * */
+int pcache_write(Inode *ino, const char *buf, offset_t offset, unsigned sz) {
+    unsigned wt = 0;
+
+    lock_mutex(&pcache.mtx);
+    while (wt < sz) {
+        Page *pg;
+        if ((pg = pcache_get(ino, offset / PAGE_SZ, true)) == 0)
+            break;
+
+        unsigned off = offset % PAGE_SZ;
+        unsigned m   = min(sz - wt, PAGE_SZ - off);
+        unsigned b0  = off / BSIZE, b1 = (off + m - 1) / BSIZE;
+        memmove(&pg->data[off], buf, m);
+        page_dirty(pg, ino, (2u << b1) - (1u << b0));
+        pg->len = max(pg->len, off + m);
+
+        wt     += m;
+        offset += m;
+        buf    += m;
+        if (offset > ino->d.size)
+            ino->d.size = offset; // logged once the data is written
+    }
+
+    if (too_dirty(ino))
+        pcache_writeback(ino);
+    unlock_mutex(&pcache.mtx);
+    return wt;
+}
+
+
+/*! Pin page `idx` of a locked inode for a user mapping, see vma.c.
+ *  A pinned page is never recycled, its memory is mapped as is.
+ *  @return  the page data, 0 if failed.
+ * */
+char *pcache_map(Inode *ino, unsigned idx) {
+    Page *pg;
+    lock_mutex(&pcache.mtx);
+    if ((pg = pcache_get(ino, idx, false)) != 0)
+        pg->nref++;
+    unlock_mutex(&pcache.mtx);
+    return pg ? pg->data : 0;
+}
+
+
+/*! Unpin a page of a locked inode that was mapped at `data`. A page
+ *  written through a shared mapping is dirtied as a whole, unless the
+ *  file was truncated below it meanwhile. With `dirty` it needs to run
+ *  inside a transaction.
+ * */
+void pcache_unmap(Inode *ino, char *data, bool dirty) {
+    lock_mutex(&pcache.mtx);
+    Page *pg = pcache.pages;
+    for (; pg < &pcache.pages[NPCACHE] && pg->data != data; ++pg);
+    if (pg == &pcache.pages[NPCACHE] || pg->nref == 0)
+        panic("pcache_unmap: page not mapped");
+
+    pg->nref--;
+    if (dirty && pg->inum == ino->inum && pg->dev == ino->dev) {
+        page_dirty(pg, ino, (1u << page_blks(pg->idx)) - 1);
+        pg->len = max(pg->len, page_len(ino, pg->idx));
+        if (too_dirty(ino))
+            pcache_writeback(ino);
+    }
+    unlock_mutex(&pcache.mtx);
+}
+
+
+/*! Write back the dirty pages of a locked inode. Needs to run inside
+ *  a transaction.
+ *  @return  false if some could not be written.
+ * */
+bool pcache_flush(Inode *ino) {
+    bool ok;
+    lock_mutex(&pcache.mtx);
+    ok = pcache_writeback(ino);
+    unlock_mutex(&pcache.mtx);
+    return ok;
+}
+
+
+/*! Write back the inodes that have a page dirty for at least `age`
+ *  ticks, each inode in its own transaction.
+ * */
+static void sync_older(unsigned age) {
+    for (Page *pg = pcache.pages; pg < &pcache.pages[NPCACHE]; ++pg) {
+        lock_mutex(&pcache.mtx);
+        Inode *ino = pg->owner && ticks - pg->dirtied >= age ? inode_dup(pg->owner) : 0;
+        unlock_mutex(&pcache.mtx);
+        if (!ino)
+            continue;
+
+        log_begin();
+        inode_lock(ino);
+        pcache_flush(ino);
+        inode_unlock(ino);
+        log_end();
+        inode_drop(ino);
+    }
+}
+
+
+/*! Write back every dirty page */
+void pcache_sync() {
+    sync_older(0);
+}
+
+
+/*! Kernel thread that writes back the pages left dirty for FLUSHDELAY
+ *  ticks, a file nobody syncs doesn't keep its data in memory only.
+ *  When kicked, it writes back every dirty page.
+ * */
+void pcache_daemon() {
+    unsigned last = ticks;
+
+    lock(&pcache.flushlk);
+    for (;;) {
+        sleep(&ticks, &pcache.flushlk);
+        if (!pcache.kick && ticks - last < FLUSHDELAY / 2)
+            continue;
+        unsigned age = pcache.kick ? 0 : FLUSHDELAY;
+        pcache.kick  = false;
+        last         = ticks;
+        unlock(&pcache.flushlk);
+        sync_older(age);
+        lock(&pcache.flushlk);
+    }
+}
+
+
+/*! Zero the block of a locked inode that holds byte `size`, from it
+ *  to the end of the block, and mark it dirty so the zeros reach the
+ *  disk. Bytes past the end of a file stay zero if it grows again. Needs
+ *  to run inside a transaction.
+ *  @return  false if the page could not be read.
+ * */
+bool pcache_zero_tail(Inode *ino, offset_t size) {
+    unsigned off = size % PAGE_SZ;
+    Page    *pg;
+
+    if (size % BSIZE == 0)
+        return true;
+
+    lock_mutex(&pcache.mtx);
+    if ((pg = pcache_get(ino, size / PAGE_SZ, true)) != 0) {
+        memset(&pg->data[off], 0, BSIZE - size % BSIZE);
+        page_dirty(pg, ino, 1u << (off / BSIZE));
+    }
+    unlock_mutex(&pcache.mtx);
+    return pg != 0;
+}
+
+
+/*! Forget the pages of a locked inode past `size`, dirty ones are not
+ *  written. The page holding the new end is zeroed after it.
+ * */
+void pcache_truncate(Inode *ino, offset_t size) {
+    lock_mutex(&pcache.mtx);
+    for (Page *pg = pcache.pages; pg < &pcache.pages[NPCACHE]; ++pg) {
+        if (pg->inum != ino->inum || pg->dev != ino->dev)
+            continue;
+        if (pg->idx * PAGE_SZ >= size) {
+            page_clean(pg);
+            pcache_unhash(pg);
+        } else if (pg->idx == size / PAGE_SZ) {
+            memset(&pg->data[size % PAGE_SZ], 0, PAGE_SZ - size % PAGE_SZ);
+            pg->len = min(pg->len, size % PAGE_SZ);
+        }
+    }
+    unlock_mutex(&pcache.mtx);
+}
+
+
+/*! Fill the compression counters of `st` */
+void pcache_stats(StatFs *st) {
+    lock_mutex(&pcache.mtx);
+    st->zin     = pcache.stats.zin;
+    st->zout    = pcache.stats.zout;
+    st->zcycles = pcache.stats.zcycles;
+    st->dcycles = pcache.stats.dcycles;
+    unlock_mutex(&pcache.mtx);
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <stdbool.h>
+#include "fdefs.fwd.h"
+#include "fs/fdefs.h"
+
+
+void  pcache_init();
+int   pcache_read(Inode *ino, char *buf, offset_t offset, unsigned sz);
+int   pcache_write(Inode *ino, const char *buf, offset_t offset, unsigned sz);
+char *pcache_map(Inode *ino, unsigned idx);
+void  pcache_unmap(Inode *ino, char *data, bool dirty);
+bool  pcache_flush(Inode *ino);
+void  pcache_sync();
+void  pcache_daemon();
+bool  pcache_zero_tail(Inode *ino, offset_t size);
+void  pcache_truncate(Inode *ino, offset_t size);
+void  pcache_stats(StatFs *st);
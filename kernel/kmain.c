@@ -21,5 +21,6 @@ void kmain(void) {
     fs_init();
     dev_init();
     process_init();
+    fs_init2();
     scheduler();
 }
@@ -1,25 +1,134 @@
+#include <stdint.h>
 #include "memory.h"
+#include "e820.h"
+#include "i386.h"
+#include "mem.h"
+#include "mmu.h"
+#include "stdlib.h"
+#include "string.h"
+#include "err.h"
+#include "driver/vga.h"
 #include "memory/gdt.h"
 #include "memory/vmem.h"
 #include "memory/palloc.h"
+#include "memory/slab.h"
+
+
+#define MEMDEFAULT  0x8000000       // memory assumed if the BIOS has no E820
+#define BOOTRESERVE (16 * PAGE_SZ)  // room for the page tables built in mem_init1
 
 
 extern char end[];  // defined in `kernel.ld.
 
-static void *ptstart = end;                           // page table start
-static void *ptend   = P2V_C(PTESZ * NPDES * NPTES);  // page table end
-static void *phystop = P2V_C(PHYSTOP);                // physical top
+physical_addr phystop; // top of the direct mapped memory
+physical_addr memtop;  // top of the memory, highmem is from phystop to memtop
+
+
+/* Usable memory from the E820 map, sorted, page aligned, without overlaps */
+typedef struct MemRange {
+    physical_addr start;
+    physical_addr end;
+} MemRange;
+
+
+static MemRange ram[E820_MAX];
+static int      nram;
+
+
+/*! Add [start, end) to `ram`, merged with the ranges it overlaps */
+static void ram_add(uint64_t start, uint64_t end) {
+    start = (start + PAGE_SZ - 1) & ~(uint64_t)(PAGE_SZ - 1);
+    end   = min(end, (uint64_t)DEV_SPACE) & ~(uint64_t)(PAGE_SZ - 1);
+    if (start >= end)
+        return;
+
+    int i = 0, j;
+    for (; i < nram && ram[i].end < start; ++i);
+    for (j = i; j < nram && ram[j].start <= end; ++j) { // overlaps
+        start = min(start, (uint64_t)ram[j].start);
+        end   = max(end, (uint64_t)ram[j].end);
+    }
+    memmove(&ram[i + 1], &ram[j], (nram - j) * sizeof(MemRange));
+    ram[i] = (MemRange){ start, end };
+    nram  += 1 - (j - i);
+}
+
+
+/*! Read the E820 map the boot loader left at E820_MAP */
+static void read_e820() {
+    E820Map *m = (E820Map *)P2V_C(E820_MAP);
+    for (unsigned i = 0; i < m->n && i < E820_MAX; ++i) {
+        if (m->e[i].type == E820_RAM)
+            ram_add(m->e[i].base, m->e[i].base + m->e[i].len);
+    }
+    if (nram == 0) {
+        vga_printf("[\033[33mboot\033[0m] no E820 map, assume %d MiB\n", MEMDEFAULT >> 20);
+        ram_add(0, MEMDEFAULT);
+    }
+}
+
+
+/*! Give the usable memory in [lo, hi) to the page allocator, [lo, hi)
+ *  is either direct mapped or highmem.
+ * */
+static void free_ram(physical_addr lo, physical_addr hi) {
+    for (int i = 0; i < nram; ++i) {
+        physical_addr s = max(lo, ram[i].start);
+        physical_addr e = min(hi, ram[i].end);
+        if (s >= e)
+            continue;
+        if (lo < phystop)
+            pfree_range(P2V_C(s), P2V_C(e));
+        else
+            pfree_high_range(s, e);
+    }
+}
 
 
-/*! Allocate space for page table and switch to the new virutal memory */
+/*! Size the memory from the E820 map, place the page arrays after the
+ *  kernel and free the rest of the first 4 MiB, the memory the boot
+ *  loader maps. Then switch to the kernel page table.
+ *
+ *  The page arrays have to fit in the first 4 MiB with the early page
+ *  tables, memory past what they can describe is left out.
+ * */
 void mem_init1() {
-    palloc_init(ptstart, ptend);
+    read_e820();
+    memtop = ram[nram - 1].end;
+
+    char *top = (char *)P2V_C(LPAGE_SZ) - BOOTRESERVE;
+    while (end + palloc_metasz(min(memtop, DIRECTSTOP), memtop) > top)
+        memtop -= LPAGE_SZ;
+    phystop = min(memtop, DIRECTSTOP);
+
+    char *meta_end = palloc_init(end, phystop, memtop);
+    free_ram(V2P_C(meta_end), LPAGE_SZ);
+    vga_printf("[\033[32mboot\033[0m] memory: %d MiB, %d MiB highmem\n",
+               phystop >> 20, (memtop - phystop) >> 20);
+
     kernel_vmem_init();
     gdt_init();
 }
 
 
-/*! Allocate free memory for user space */
+/*! Map the direct mapped memory above 4 MiB and free it, 4 MiB at a
+ *  time so the page tables of a chunk come from the chunks before it.
+ *  Then free the highmem.
+ * */
 void mem_init2() {
-    palloc_init(ptend, phystop);
+    vga_printf("[\033[32mboot\033[0m] free memory...");
+    uint64_t t0 = rdtsc();
+    for (physical_addr p = LPAGE_SZ; p < phystop; p += LPAGE_SZ) {
+        physical_addr e = min(p + LPAGE_SZ, phystop);
+        if (!kernel_vmem_map(p, e))
+            panic("mem_init2: out of memory");
+        free_ram(p, e);
+    }
+    free_ram(phystop, memtop);
+
+    MemStat st;
+    palloc_stat(&st);
+    vga_printf("\033[32mok\033[0m (%d pages, %d highmem, %d cycles)\n",
+               st.pages, st.high, (unsigned)(rdtsc() - t0));
+    slab_init();
 }
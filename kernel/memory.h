@@ -1,4 +1,8 @@
 #pragma once
+#include "i386.h"
+
+extern physical_addr phystop;
+extern physical_addr memtop;
 
 void mem_init1();
 void mem_init2();
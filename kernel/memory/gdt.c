@@ -67,6 +67,16 @@ void gdt_init() {
         cpu.gdt[SEG_UDATA] = create_descriptor(0, 0xffffffff, flag);
     }
 
+    {   // task state, only esp0 changes afterwards, see `switch_user_vmem`
+        uint16_t flag = SEG_S(0)       | SEG_P(1)  | SEG_AVL(0) |
+                        SEG_L(0)       | SEG_DB(1) | SEG_G(0)   |
+                        SEG_DPL(DPL_K) | SEG_TSS_32_AVL;
+        cpu.ts.ss0         = SEG_KDATA << 3;
+        cpu.ts.iobp        = sizeof(TaskState); // no IO permission bitmap
+        cpu.gdt[SEG_TSS]   = create_descriptor((uintptr_t)&cpu.ts, sizeof(TaskState) - 1, flag);
+    }
+
     lgdt((void*)&cpu.gdtr);
+    ltr(SEG_TSS << 3);
     vga_printf("\033[32moki\033[0m\n");
 }
@@ -1,35 +1,223 @@
 #include <stdint.h>
 #include "palloc.h"
 #include "mem.h"
+#include "mmu.h"
+#include "i386.h"
 #include "err.h"
-#include "driver/vga.h"
+#include "string.h"
 
 extern char end[];
 
+#define PG_FREE 0x80 // first page of a free block, the low bits are its order
 
-/* memory list */
+#define PALLOC_BENCH 0 // free the boot memory page by page, to time it
+
+
+/* Buddy allocator
+ *
+ * Free memory is kept in blocks of 2^order pages, aligned on their size,
+ * with one free list per order up to MAXORDER (4 MiB). An allocation
+ * takes the smallest block that fits and splits it, the halves it
+ * doesn't use go to the lower lists. A freed block is merged with its
+ * buddy, the other half of the block they were split from, as long as
+ * the buddy is free as a whole:
+ *
+ *     buddy pfn = pfn ^ (1 << order)
+ *
+ * `state` marks the first page of every free block with PG_FREE and
+ * its order, so finding whether a buddy is free is one lookup.
+ *
+ * Every allocated block has a reference count, kept on its first page,
+ * and its order in `state`, so it can be freed without knowing its size.
+ * `palloc` hands out a page with one reference, a page shared by copy
+ * on write fork gets one per process with `pdup`, and `pfree` drops one.
+ * The page goes back to the free lists with the last reference.
+ * `palloc`/`pfree` are the order 0 case of `palloc_pages`/`pfree_pages`,
+ * with a non empty order 0 list they only pop or push a page.
+ *
+ * The buddy allocator only manages the direct mapped memory below
+ * `phystop`, it needs to write in the free pages. The memory above,
+ * highmem, is a bitmap of free pages handed out one at a time by
+ * physical address with `palloc_phys`, for user pages. The kernel gets
+ * to a highmem page through the kmap window (vmem.c).
+ *
+ * The page arrays are sized for the memory found at boot, they are
+ * placed after the kernel by `palloc_init`.
+ * */
 typedef struct KernelMem {
-    Run *freelist;
+    Run      *free[MAXORDER + 1];
+    unsigned  nfree[MAXORDER + 1]; // free blocks per order
+    unsigned  npages;              // direct mapped pages given to the allocator
+    unsigned  nlow;                // pages below phystop
+    uint8_t  *refs;                // per page of memory
+    uint8_t  *state;               // per direct mapped page
+    uint32_t *highfree;            // bitmap of the free highmem pages
+    unsigned  nhigh;               // pages from phystop to the top of memory
+    unsigned  highpages;           // highmem pages given to the allocator
+    unsigned  nhighfree;
+    unsigned  highnext;            // bitmap word the next search starts at
 } KernelMem;
 
 
 KernelMem kernel_mem;
 
 
-/*! free the memory in range [vstart, vend) */
-void pfree_range(void *vstart, void *vend) {
-    char *p = (char *)vstart;
-    for (; p + PAGE_SZ <= (char *)vend; p += PAGE_SZ) {
+static unsigned pfn(const char *v) { return V2P_C(v) / PAGE_SZ; }
+
+
+static char *pfn_addr(unsigned n) { return (char *)P2V_C(n * PAGE_SZ); }
+
+
+static uint8_t *page_refs(const char *v) {
+    return &kernel_mem.refs[pfn(v)];
+}
+
+
+static unsigned nbitmap(unsigned nhigh) { return (nhigh + 31) / 32; }
+
+
+static void list_push(char *v, unsigned order) {
+    Run *r  = (Run *)v;
+    r->prev = 0;
+    r->next = kernel_mem.free[order];
+    if (r->next)
+        r->next->prev = r;
+    kernel_mem.free[order]   = r;
+    kernel_mem.state[pfn(v)] = PG_FREE | order;
+    kernel_mem.nfree[order]++;
+}
+
+
+static void list_remove(char *v, unsigned order) {
+    Run *r = (Run *)v;
+    if (r->prev) r->prev->next          = r->next;
+    else         kernel_mem.free[order] = r->next;
+    if (r->next)
+        r->next->prev = r->prev;
+    kernel_mem.state[pfn(v)] = 0;
+    kernel_mem.nfree[order]--;
+}
+
+
+/*! Put a block back on the free lists, merged with its free buddies */
+static void buddy_free(char *v, unsigned order) {
+    unsigned n = pfn(v);
+    for (; order < MAXORDER; ++order) {
+        unsigned b = n ^ (1u << order);
+        if (b >= kernel_mem.nlow || kernel_mem.state[b] != (PG_FREE | order))
+            break;
+        list_remove(pfn_addr(b), order);
+        n &= ~(1u << order);
+    }
+    list_push(pfn_addr(n), order);
+}
+
+
+#if PALLOC_BENCH
+/*! free the memory in range [p, e) one page at a time, the way boot
+ *  used to. Kept to compare with `pfree_range`.
+ * */
+static void pfree_pages_each(char *p, char *e) {
+    for (; p + PAGE_SZ <= e; p += PAGE_SZ) {
+        *page_refs(p) = 1;
+        kernel_mem.npages++;
         pfree(p);
     }
 }
+#endif
+
+
+/*! free the memory in range [vstart, vend). The range is cut in the
+ *  largest aligned blocks that fit and each block is put on the free
+ *  lists as a whole, merged with a free buddy from a previous range.
+ *  Only the first page of a block is written, a 4 MiB block costs one
+ *  write instead of 1024.
+ * */
+void pfree_range(void *vstart, void *vend) {
+    char *p = (char *)page_aligndown((uintptr_t)vstart + PAGE_SZ - 1);
+    char *e = (char *)page_aligndown((uintptr_t)vend);
 
+    if (p < end || pfn(e) > kernel_mem.nlow)
+        panic("pfree_range: range out of memory");
 
-/*! free the memory from vstart to vend */
-void palloc_init(void *vstart, void *vend) {
-    vga_printf("[\033[32mboot\033[0m] palloc_init...");
-    pfree_range(vstart, vend);
-    vga_printf("\033[32mok\033[0m\n");
+#if PALLOC_BENCH
+    pfree_pages_each(p, e);
+#else
+    while (p < e) {
+        unsigned o = 0;
+        unsigned n = pfn(p);
+        while (o < MAXORDER && n % (2u << o) == 0 && p + (PAGE_SZ << (o + 1)) <= e)
+            o++;
+        kernel_mem.npages += 1u << o;
+        buddy_free(p, o);
+        p += PAGE_SZ << o;
+    }
+#endif
+}
+
+
+/*! free the highmem in range [start, end) */
+void pfree_high_range(physical_addr pstart, physical_addr pend) {
+    unsigned n = pstart / PAGE_SZ;
+    if (n < kernel_mem.nlow || pend / PAGE_SZ > kernel_mem.nlow + kernel_mem.nhigh)
+        panic("pfree_high_range: range out of memory");
+
+    for (; n < pend / PAGE_SZ; ++n) {
+        unsigned i = n - kernel_mem.nlow;
+        kernel_mem.highfree[i / 32] |= 1u << (i % 32);
+        kernel_mem.highpages++;
+        kernel_mem.nhighfree++;
+    }
+}
+
+
+/*! Bytes of page arrays for the memory up to `top`, direct mapped up to
+ *  `lowtop`.
+ * */
+size_t palloc_metasz(physical_addr lowtop, physical_addr top) {
+    unsigned n = top / PAGE_SZ, nlow = lowtop / PAGE_SZ;
+    return page_alignup(n + nlow + nbitmap(n - nlow) * sizeof(uint32_t));
+}
+
+
+/*! Place the page arrays at `meta` for the memory up to `top`, direct
+ *  mapped up to `lowtop`. All the memory is in use until it's freed by
+ *  `pfree_range` and `pfree_high_range`.
+ *  @return  the end of the arrays.
+ * */
+char *palloc_init(char *meta, physical_addr lowtop, physical_addr top) {
+    size_t sz = palloc_metasz(lowtop, top);
+    memset(meta, 0, sz);
+    kernel_mem.nlow     = lowtop / PAGE_SZ;
+    kernel_mem.nhigh    = (top - lowtop) / PAGE_SZ;
+    kernel_mem.refs     = (uint8_t *)meta;
+    kernel_mem.state    = kernel_mem.refs + top / PAGE_SZ;
+    kernel_mem.highfree = (uint32_t *)(kernel_mem.state + kernel_mem.nlow);
+    return meta + sz;
+}
+
+
+/*! alloc 2^order physically contiguous pages, aligned on their size.
+ *  return 0 if the memory cannot be allocated.
+ * */
+char *palloc_pages(unsigned order) {
+    unsigned o = order;
+    for (; o <= MAXORDER && !kernel_mem.free[o]; ++o);
+
+    if (o > MAXORDER) {
+        perror("palloc: no memory available\n");
+        return 0;
+    }
+
+    char *v = (char *)kernel_mem.free[o];
+    list_remove(v, o);
+    while (o > order) { // split, the upper half goes back
+        o--;
+        list_push(v + (PAGE_SZ << o), o);
+    }
+    *page_refs(v)            = 1;
+    kernel_mem.state[pfn(v)] = order;
+    return v;
 }
 
 
@@ -37,37 +225,127 @@ void palloc_init(void *vstart, void *vend) {
  *  return 0 if the memory cannot be allocated.
  * */
 char *palloc() {
-    Run *r = kernel_mem.freelist;
+    return palloc_pages(0);
+}
 
-    if (r) {
-        kernel_mem.freelist = r->next;
-    } else {
-        perror("palloc: no memory available\n");
+
+/*! alloc a page anywhere in memory, highmem first.
+ *  return its physical address, 0 if the memory cannot be allocated.
+ * */
+physical_addr palloc_phys() {
+    unsigned nw = nbitmap(kernel_mem.nhigh);
+    for (unsigned k = 0; kernel_mem.nhighfree && k < nw; ++k) {
+        unsigned  w   = (kernel_mem.highnext + k) % nw;
+        uint32_t *map = &kernel_mem.highfree[w];
+        if (*map == 0)
+            continue;
+
+        unsigned b = __builtin_ctz(*map);
+        unsigned n = kernel_mem.nlow + w * 32 + b;
+        *map &= ~(1u << b);
+        kernel_mem.nhighfree--;
+        kernel_mem.highnext = w;
+        kernel_mem.refs[n]  = 1;
+        return n * PAGE_SZ;
     }
-    return (char *)r;
+
+    char *v;
+    return (v = palloc()) != 0 ? V2P_C(v) : 0;
 }
 
 
-/*! free a page of physical memory pointed by v
- *  v needs to align at page boundry otherwise we panic.
+/*! drop a reference of the page at `pa` from `palloc_phys`, the last
+ *  one frees it.
+ * */
+void pfree_phys(physical_addr pa) {
+    unsigned n = pa / PAGE_SZ;
+    if (n < kernel_mem.nlow) {
+        pfree((char *)P2V_C(pa));
+        return;
+    }
+
+    if (n >= kernel_mem.nlow + kernel_mem.nhigh || pa % PAGE_SZ)
+        panic("pfree_phys, invalid physical address");
+    if (kernel_mem.refs[n] == 0)
+        panic("pfree_phys, page is already free");
+    if (--kernel_mem.refs[n] > 0)
+        return;
+
+    unsigned i = n - kernel_mem.nlow;
+    kernel_mem.highfree[i / 32] |= 1u << (i % 32);
+    kernel_mem.nhighfree++;
+}
+
+
+/*! Add a reference to the page at `pa` */
+void pdup(physical_addr pa) {
+    uint8_t *r = &kernel_mem.refs[pa / PAGE_SZ];
+    if (*r == 0)
+        panic("pdup: page is free");
+    if (*r == 0xff)
+        panic("pdup: too many references");
+    (*r)++;
+}
+
+
+/*! Order of the allocated block starting at `v` */
+unsigned porder(char *v) {
+    return kernel_mem.state[pfn(v)] & ~PG_FREE;
+}
+
+
+/*! Number of references of the page at `pa` */
+unsigned prefs(physical_addr pa) {
+    return kernel_mem.refs[pa / PAGE_SZ];
+}
+
+
+/*! drop a reference of the block of 2^order pages pointed by v, the
+ *  last one frees it. v needs to align at the block size otherwise we
+ *  panic.
  *
  *  @v:  virtual address
  * */
-void pfree(char *v) {
-    if (V2P_C(v) >= PHYSTOP) {
-        panic("pfree, physical address exceeds PHYSTOP");
+void pfree_pages(char *v, unsigned order) {
+    if (pfn(v) >= kernel_mem.nlow) {
+        panic("pfree, physical address exceeds phystop");
     }
 
     if (v < end) {
         panic("pfree, invalid virtual address");
     }
 
-    if ((uint32_t)v % PAGE_SZ) {
-        panic("pfree, address not on page boundry");
+    if (order > MAXORDER || pfn(v) % (1u << order)) {
+        panic("pfree, address not on block boundry");
     }
 
-    Run* r = (Run *)v;
+    if (*page_refs(v) == 0)
+        panic("pfree, page is already free");
+
+    if (--(*page_refs(v)) > 0)
+        return;
+
+    buddy_free(v, order);
+}
+
 
-    r->next = kernel_mem.freelist;
-    kernel_mem.freelist = r;
+/*! free a page of physical memory pointed by v, see `pfree_pages` */
+void pfree(char *v) {
+    pfree_pages(v, 0);
+}
+
+
+/*! Fill the allocator statistics. The fragmentation can be read from
+ *  the free blocks per order: free memory that only sits in small
+ *  blocks can't serve a large allocation.
+ * */
+void palloc_stat(MemStat *st) {
+    st->pages    = kernel_mem.npages;
+    st->free     = 0;
+    st->high     = kernel_mem.highpages;
+    st->highfree = kernel_mem.nhighfree;
+    for (unsigned o = 0; o <= MAXORDER; ++o) {
+        st->blocks[o] = kernel_mem.nfree[o];
+        st->free     += kernel_mem.nfree[o] << o;
+    }
 }
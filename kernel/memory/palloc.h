@@ -1,6 +1,34 @@
 #pragma once
+#include <stddef.h>
+#include "i386.h"
 
-void  palloc_init(void *vstart, void *vend);
-char *palloc();
-void  pfree(char *);
-typedef struct Run { struct Run *next; } Run;
+#define MAXORDER 10 // largest block is 2^MAXORDER pages
+
+
+typedef struct Run { struct Run *next, *prev; } Run;
+
+
+/* physical memory usage */
+typedef struct MemStat {
+    unsigned pages;                // direct mapped pages managed by the allocator
+    unsigned free;                 // free pages
+    unsigned blocks[MAXORDER + 1]; // free blocks of 2^i pages
+    unsigned high;                 // highmem pages
+    unsigned highfree;             // free highmem pages
+} MemStat;
+
+
+size_t        palloc_metasz(physical_addr lowtop, physical_addr top);
+char         *palloc_init(char *meta, physical_addr lowtop, physical_addr top);
+void          pfree_range(void *vstart, void *vend);
+void          pfree_high_range(physical_addr pstart, physical_addr pend);
+char         *palloc();
+char         *palloc_pages(unsigned order);
+void          pfree(char *);
+void          pfree_pages(char *, unsigned order);
+physical_addr palloc_phys();
+void          pfree_phys(physical_addr pa);
+void          pdup(physical_addr pa);
+unsigned      prefs(physical_addr pa);
+unsigned      porder(char *);
+void          palloc_stat(MemStat *st);
@@ -0,0 +1,281 @@
+#include <stdint.h>
+#include "defs.h"
+#include "mem.h"
+#include "mmu.h"
+#include "err.h"
+#include "string.h"
+#include "ncli.h"
+#include "process/pdefs.h"
+#include "process/proc.h"
+#include "memory/palloc.h"
+#include "memory/slab.h"
+#include "driver/vga.h"
+
+#define KMALLOC_MIN 4  // smallest kmalloc cache is 2^4 bytes
+#define KMALLOC_MAX 10 // largest kmalloc cache is 2^10 bytes, more takes pages
+
+extern CPU cpu;
+
+
+/* Slab allocator
+ *
+ * A cache hands out objects of one type. It takes its memory from
+ * `palloc` one page at a time, a slab, and cuts it into objects. The
+ * slab header sits at the start of the page so the slab of an object is
+ * its page:
+ *
+ *     | Slab | obj | link | obj | link | ... |
+ *
+ * The free objects of a slab are chained through the `link` word after
+ * each object. It's kept out of the object so a free object stays as
+ * the constructor built it: `ctor` runs once when the slab is created
+ * and an object has to be freed in its constructed state, allocating it
+ * again costs nothing.
+ *
+ * Each cpu keeps a magazine of free objects per cache. `kcache_alloc`
+ * and `kcache_free` only pop and push it with interrupts off, the cache
+ * lock is taken when the magazine is empty or full, to move half a
+ * magazine from or to the slabs.
+ *
+ * A slab that becomes empty is kept if the cache has no other empty
+ * slab, otherwise its page goes back to `palloc`.
+ *
+ * `kmalloc` serves power of two sizes from 16 to 1024 bytes with one
+ * cache per size, larger sizes take a block of pages.
+ * */
+struct Slab {
+    Slab     *next;
+    Slab     *prev;
+    KCache   *cache;
+    unsigned  inuse; // objects allocated, magazines count as allocated
+    char     *free;  // first free object
+};
+
+
+typedef struct KCacheTable {
+    SpinLock lk;
+    KCache   t[NKCACHE];
+} KCacheTable;
+
+
+static KCacheTable kcaches;
+static KCache     *kmalloc_caches[KMALLOC_MAX + 1];
+
+
+static size_t word_align(size_t n) {
+    return (n + sizeof(char *) - 1) & ~(sizeof(char *) - 1);
+}
+
+
+static char **obj_link(KCache *c, char *obj) {
+    return (char **)(obj + c->size - sizeof(char *));
+}
+
+
+static char *slab_objs(Slab *s) {
+    return (char *)s + word_align(sizeof(Slab));
+}
+
+
+static unsigned cpu_index() {
+    return this_cpu() - &cpu;
+}
+
+
+static void slab_push(Slab **list, Slab *s) {
+    s->prev = 0;
+    s->next = *list;
+    if (s->next)
+        s->next->prev = s;
+    *list = s;
+}
+
+
+static void slab_remove(Slab **list, Slab *s) {
+    if (s->prev) s->prev->next = s->next;
+    else         *list         = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+}
+
+
+/*! The list a slab belongs to by its number of used objects */
+static Slab **slab_list(KCache *c, Slab *s) {
+    if (s->inuse == 0)          return &c->empty;
+    if (s->inuse == c->perslab) return &c->full;
+    return &c->partial;
+}
+
+
+/*! Add a slab to the cache, its objects constructed.
+ *  @return  0 if there is no memory.
+ * */
+static Slab *slab_grow(KCache *c) {
+    Slab *s;
+    if ((s = (Slab *)palloc()) == 0)
+        return 0;
+
+    s->cache = c;
+    s->inuse = 0;
+    s->free  = 0;
+    for (int i = c->perslab - 1; i >= 0; --i) {
+        char *obj = slab_objs(s) + i * c->size;
+        if (c->ctor)
+            c->ctor(obj);
+        *obj_link(c, obj) = s->free;
+        s->free           = obj;
+    }
+    slab_push(&c->empty, s);
+    c->nslabs++;
+    return s;
+}
+
+
+/*! Take a free object from the slabs, 0 if out of memory */
+static void *slab_get(KCache *c) {
+    Slab *s;
+    if ((s = c->partial) == 0 && (s = c->empty) == 0 && (s = slab_grow(c)) == 0)
+        return 0;
+
+    char *obj = s->free;
+    slab_remove(slab_list(c, s), s);
+    s->free = *obj_link(c, obj);
+    s->inuse++;
+    slab_push(slab_list(c, s), s);
+    return obj;
+}
+
+
+/*! Return an object to its slab */
+static void slab_put(KCache *c, char *obj) {
+    Slab *s = (Slab *)page_aligndown((uintptr_t)obj);
+    if (s->cache != c)
+        panic("slab_put: object from another cache");
+
+    slab_remove(slab_list(c, s), s);
+    *obj_link(c, obj) = s->free;
+    s->free           = obj;
+    s->inuse--;
+
+    if (s->inuse == 0 && c->empty) { // keep one empty slab
+        pfree((char *)s);
+        c->nslabs--;
+        return;
+    }
+    slab_push(slab_list(c, s), s);
+}
+
+
+/*! Create a cache of objects of `size` bytes. `ctor` builds an object
+ *  when its slab is created, objects are freed in that state.
+ *  @return  the cache, 0 if there is no slot left.
+ * */
+KCache *kcache_create(const char *name, size_t size, void (*ctor)(void *)) {
+    size_t sz = word_align(size) + sizeof(char *);
+    if (size == 0 || sz > PAGE_SZ - word_align(sizeof(Slab)))
+        panic("kcache_create: bad object size");
+
+    lock(&kcaches.lk);
+    KCache *c = kcaches.t;
+    for (; c < &kcaches.t[NKCACHE] && c->name; ++c);
+    if (c == &kcaches.t[NKCACHE]) {
+        unlock(&kcaches.lk);
+        return 0;
+    }
+    memset(c, 0, sizeof(KCache));
+    c->name = name;
+    unlock(&kcaches.lk);
+
+    c->lk      = new_lock(name);
+    c->objsz   = size;
+    c->size    = sz;
+    c->perslab = (PAGE_SZ - word_align(sizeof(Slab))) / sz;
+    c->ctor    = ctor;
+    return c;
+}
+
+
+/*! Allocate an object of the cache
+ *  @return  the object, 0 if there is no memory.
+ * */
+void *kcache_alloc(KCache *c) {
+    void *obj = 0;
+    push_cli();
+    Magazine *m = &c->mag[cpu_index()];
+    if (m->n == 0) {
+        lock(&c->lk);
+        while (m->n < MAGSZ / 2 && (obj = slab_get(c)) != 0)
+            m->objs[m->n++] = obj;
+        unlock(&c->lk);
+    }
+    obj = m->n > 0 ? m->objs[--m->n] : 0;
+    pop_cli();
+    return obj;
+}
+
+
+/*! Free an object of the cache, it needs to be in its constructed state */
+void kcache_free(KCache *c, void *obj) {
+    push_cli();
+    Magazine *m = &c->mag[cpu_index()];
+    if (m->n == MAGSZ) {
+        lock(&c->lk);
+        while (m->n > MAGSZ / 2)
+            slab_put(c, m->objs[--m->n]);
+        unlock(&c->lk);
+    }
+    m->objs[m->n++] = obj;
+    pop_cli();
+}
+
+
+/*! Allocate `n` bytes, from the cache of the next power of two or from
+ *  whole pages above 2^KMALLOC_MAX bytes.
+ *  @return  the memory, 0 if there is no memory.
+ * */
+void *kmalloc(size_t n) {
+    unsigned o = KMALLOC_MIN;
+    if (n == 0)
+        return 0;
+
+    if (n <= (1u << KMALLOC_MAX)) {
+        for (; (1u << o) < n; ++o);
+        return kcache_alloc(kmalloc_caches[o]);
+    }
+
+    for (o = 0; ((size_t)PAGE_SZ << o) < n && o <= MAXORDER; ++o);
+    return o <= MAXORDER ? palloc_pages(o) : 0;
+}
+
+
+/*! Free memory from `kmalloc`. A slab object is never page aligned, the
+ *  slab header is at the start of the page.
+ * */
+void kfree(void *p) {
+    if (p == 0)
+        return;
+    if ((uintptr_t)p % PAGE_SZ == 0) {
+        pfree_pages(p, porder(p));
+        return;
+    }
+    Slab *s = (Slab *)page_aligndown((uintptr_t)p);
+    kcache_free(s->cache, p);
+}
+
+
+/*! Create the kmalloc caches */
+void slab_init() {
+    static const char *names[KMALLOC_MAX + 1] = {
+        [4] = "kmalloc-16",  [5] = "kmalloc-32",  [6]  = "kmalloc-64",
+        [7] = "kmalloc-128", [8] = "kmalloc-256", [9]  = "kmalloc-512",
+        [10] = "kmalloc-1024",
+    };
+
+    vga_printf("[\033[32mboot\033[0m] slab_init...");
+    kcaches.lk = new_lock("kcaches.lk");
+    for (unsigned o = KMALLOC_MIN; o <= KMALLOC_MAX; ++o) {
+        if ((kmalloc_caches[o] = kcache_create(names[o], 1u << o, 0)) == 0)
+            panic("slab_init");
+    }
+    vga_printf("\033[32mok\033[0m\n");
+}
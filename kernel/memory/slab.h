@@ -0,0 +1,40 @@
+#pragma once
+#include <stddef.h>
+#include "defs.h"
+#include "process/spinlock.h"
+
+#define MAGSZ 16 // objects per magazine
+
+
+typedef struct Slab Slab;
+
+
+/* Objects freed on a cpu, reused by it without taking the cache lock */
+typedef struct Magazine {
+    unsigned n;
+    void    *objs[MAGSZ];
+} Magazine;
+
+
+/* A cache of objects of the same type, see slab.c */
+typedef struct KCache {
+    SpinLock    lk;
+    const char *name;                 // 0 if the slot is free
+    size_t      objsz;                // object size given at creation
+    size_t      size;                 // object size plus the free list link
+    unsigned    perslab;              // objects per slab
+    void      (*ctor)(void *);        // build an object, can be 0
+    Slab       *partial;              // slabs with used and free objects
+    Slab       *full;                 // slabs without free objects
+    Slab       *empty;                // at most one slab without used objects
+    unsigned    nslabs;
+    Magazine    mag[NCPU];
+} KCache;
+
+
+void    slab_init();
+KCache *kcache_create(const char *name, size_t size, void (*ctor)(void *));
+void   *kcache_alloc(KCache *c);
+void    kcache_free(KCache *c, void *obj);
+void   *kmalloc(size_t n);
+void    kfree(void *p);
@@ -0,0 +1,227 @@
+#include "defs.h"
+#include "mem.h"
+#include "mmu.h"
+#include "string.h"
+#include "stdlib.h"
+#include "process.h"
+#include "process/pdefs.h"
+#include "memory/palloc.h"
+#include "memory/vma.h"
+#include "memory/vmem.h"
+#include "fs/fdefs.h"
+#include "fs/file.h"
+#include "fs/inode.h"
+#include "fs/log.h"
+#include "fs/pcache.h"
+
+/* File mappings (mmap).
+ *
+ * A process maps a file in [MMAP_BASE, KERN_BASE) with `vma_map`. No
+ * page is mapped and nothing is read then, the page fault handler fills
+ * the PTEs on the first access, see `vma_fault`:
+ *
+ *     - MAP_SHARED maps the page of the page cache itself (pcache.c),
+ *       writable if the mapping is. A page written through it is dirtied
+ *       in the page cache when it's unmapped (PTE_D) and is written back
+ *       with the other dirty pages of the file.
+ *     - MAP_PRIVATE maps the page of the page cache read only. The first
+ *       write copies it to a page of the process.
+ *
+ * A mapped page cache page is pinned until it's unmapped. The mappings
+ * are not inherited by `fork` and are removed at `exit`.
+ * */
+
+
+/*! Find the mapping of `va`, 0 if none */
+static VMArea *vma_find(Process *p, uintptr_t va) {
+    for (VMArea *v = p->vma; v < &p->vma[NVMA]; ++v) {
+        if (v->start && va >= v->start && va < v->end)
+            return v;
+    }
+    return 0;
+}
+
+
+/*! Find a free range of `len` bytes in [MMAP_BASE, KERN_BASE), the
+ *  lowest one that fits. Return 0 if there is none.
+ * */
+static uintptr_t vma_place(Process *p, size_t len) {
+    uintptr_t at = MMAP_BASE;
+    for (;;) {
+        VMArea *hit = 0;
+        for (VMArea *v = p->vma; v < &p->vma[NVMA]; ++v) {
+            if (v->start && v->start < at + len && at < v->end)
+                hit = v;
+        }
+        if (!hit)
+            return KERN_BASE - at >= len ? at : 0;
+        at = hit->end;
+    }
+}
+
+
+/*! Map `len` bytes of the file `f` from `off` into the process.
+ *  @return  the start of the mapping, 0 if failed.
+ * */
+uintptr_t vma_map(Process *p, File *f, offset_t off, size_t len, int prot, int flags) {
+    if (f->type != FD_INODE || f->ino->d.type != F_FILE) return 0;
+    if (len == 0 || len > KERN_BASE - MMAP_BASE)       return 0;
+    if (off % PAGE_SZ)                                   return 0;
+    if (flags != MAP_SHARED && flags != MAP_PRIVATE)     return 0;
+    if (!(prot & PROT_READ) || !f->readable)             return 0;
+    if (flags == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+        return 0;
+
+    len = page_alignup(len);
+    VMArea *v = p->vma;
+    for (; v < &p->vma[NVMA] && v->start; ++v);
+    if (v == &p->vma[NVMA])
+        return 0;
+
+    uintptr_t start;
+    if ((start = vma_place(p, len)) == 0)
+        return 0;
+
+    v->start = start;
+    v->end   = start + len;
+    v->f     = file_dup(f);
+    v->off   = off;
+    v->prot  = prot;
+    v->flags = flags;
+    return start;
+}
+
+
+/*! Return the page mapped by `pte` of a mapping */
+static void vma_release(VMArea *v, PTE pte) {
+    char *data = (char *)P2V_C(pte_addr(pte));
+    if ((v->flags & MAP_PRIVATE) && (pte & PTE_W)) // private copy
+        pfree(data);
+    else
+        pcache_unmap(v->f->ino, data, (v->flags & MAP_SHARED) && (pte & PTE_D));
+}
+
+
+/*! Unmap the pages of `v` in [start, end) */
+static void vma_unmap_pages(Process *p, VMArea *v, uintptr_t start, uintptr_t end) {
+    Inode *ino = v->f->ino;
+    log_begin();
+    inode_lock(ino);
+    for (uintptr_t va = start; va < end; va += PAGE_SZ) {
+        PTE pte;
+        if ((pte = unmap_user_page(p->pgdir, (void *)va)) != 0)
+            vma_release(v, pte);
+    }
+    inode_unlock(ino);
+    log_end();
+}
+
+
+/*! Remove the mappings in [start, end) of the process. A mapping that
+ *  is cut in the middle takes a second slot.
+ *  @return  0 on success, -1 if there is no slot for the split.
+ * */
+int vma_unmap(Process *p, uintptr_t start, uintptr_t end) {
+    start = page_aligndown(start);
+    end   = page_alignup(end);
+
+    VMArea *spare = 0;
+    for (VMArea *v = p->vma; v < &p->vma[NVMA]; ++v) {
+        if (!v->start)
+            spare = v;
+    }
+
+    for (VMArea *v = p->vma; v < &p->vma[NVMA]; ++v) {
+        if (!v->start || v->end <= start || end <= v->start)
+            continue;
+        if (v->start < start && end < v->end) { // split
+            if (!spare)
+                return -1;
+            *spare       = *v;
+            spare->start = end;
+            spare->off  += end - v->start;
+            file_dup(v->f);
+        }
+
+        uintptr_t lo = max(start, v->start);
+        uintptr_t hi = min(end, v->end);
+        vma_unmap_pages(p, v, lo, hi);
+
+        if (lo == v->start && hi == v->end) {
+            file_close(v->f);
+            memset(v, 0, sizeof(VMArea));
+        } else if (lo == v->start) {
+            v->off  += hi - v->start;
+            v->start = hi;
+        } else {
+            v->end = lo;
+        }
+    }
+    return 0;
+}
+
+
+/*! Fill the PTE of a faulting address in a mapping of the current
+ *  process.
+ *  @err     error code of the page fault
+ *  @return  false if the access is not allowed, or past the end of
+ *           the file.
+ * */
+bool vma_fault(Process *p, uintptr_t va, unsigned err) {
+    VMArea *v;
+    bool    write = err & FEC_WR;
+    if ((v = vma_find(p, va)) == 0)
+        return false;
+    if (write && !(v->prot & PROT_WRITE))
+        return false;
+
+    va = page_aligndown(va);
+    PTE  *pte = find_user_pte(p->pgdir, (void *)va);
+    PTE   old = pte && (*pte & PTE_P) ? *pte : 0;
+    if (old && (!write || (v->flags & MAP_SHARED) || (old & PTE_W)))
+        return false; // not a fault we cause
+
+    Inode   *ino = v->f->ino;
+    offset_t off = v->off + (va - v->start);
+    char    *data, *mem = 0;
+    int      perm = PTE_U;
+
+    inode_lock(ino);
+    if (off >= ino->d.size) {
+        inode_unlock(ino);
+        return false;
+    }
+    if (old) {
+        data = (char *)P2V_C(pte_addr(old));
+    } else if ((data = pcache_map(ino, off / PAGE_SZ)) == 0) {
+        inode_unlock(ino);
+        return false;
+    }
+
+    if ((v->flags & MAP_PRIVATE) && write) { // copy on write
+        if ((mem = palloc()) == 0) {
+            if (!old) pcache_unmap(ino, data, false);
+            inode_unlock(ino);
+            return false;
+        }
+        memmove(mem, data, PAGE_SZ);
+        pcache_unmap(ino, data, false);
+        data  = mem;
+        perm |= PTE_W;
+    } else if ((v->flags & MAP_SHARED) && (v->prot & PROT_WRITE)) {
+        perm |= PTE_W;
+    }
+    inode_unlock(ino);
+
+    if (!map_user_page(p->pgdir, (void *)va, V2P_C(data), perm)) {
+        if (mem) {
+            pfree(mem);
+        } else {
+            inode_lock(ino);
+            pcache_unmap(ino, data, false);
+            inode_unlock(ino);
+        }
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,10 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "process/pdefs.h"
+
+
+uintptr_t vma_map(Process *p, File *f, offset_t off, size_t len, int prot, int flags);
+int       vma_unmap(Process *p, uintptr_t start, uintptr_t end);
+bool      vma_fault(Process *p, uintptr_t va, unsigned err);
@@ -14,6 +14,7 @@
 #include "memory/gdt.h"
 #include "memory/palloc.h"
 #include "process/proc.h"
+#include "memory.h"
 
 #define DEBUG 0
 
@@ -21,16 +22,25 @@
 extern char data[];              // defined by kernel.ld
 PD         *kernel_page_dir;     // kernel only page directory.
 VMap        kmap[4];
+static bool pse;                 // 4 MiB pages are supported
+static bool pge;                 // global pages are supported
+static PTE *kmap_pt;             // page table of the kmap window
 
 
 /*! There is one page table for each process. The following
  *  mapping for kernel space presents on every processes'
- *  page table.
+ *  page table. It's built once in `kernel_page_dir`, and the
+ *  processes share its page tables.
  *
  *      KERN_BASE..KERN_BASE+EXTMEM => 0..EXTMEM
  *      KERN_BASE+EXTMEM..data      => EXTMEM..V2P(data)
- *      data..KERN_BASE+PHYSTOP     => V2P(data)..PHYSTOP
+ *      data..KERN_BASE+phystop     => V2P(data)..phystop
+ *      KMAP_BASE..+LPAGE_SZ        => highmem pages, see `kmap_page`
  *      DEV_SPACE..0                => DEV_SPACE..0
+ *
+ *  `kmap` maps the direct map up to 4 MiB, the memory the boot loader
+ *  maps. The rest is mapped by `kernel_vmem_map` as it's found, before
+ *  the first process copies the kernel PDEs.
  * */
 static void init_kmap() {
     // IO space
@@ -53,7 +63,7 @@ static void init_kmap() {
         // kernel data & memory
         { .virt   = (void *)(data),
           .pstart = V2P_C(data),
-          .pend   = PHYSTOP,
+          .pend   = LPAGE_SZ,
           .perm   = PTE_W
         };
 
@@ -73,23 +83,11 @@ static PDE *get_pde(PD *page_dir, const void *vaddr) {
 }
 
 
-static PTE *get_pt(PD *page_dir, const void *vaddr) {
-    PDE *pde = get_pde(page_dir, vaddr);
-    return (PTE *)P2V(pte_addr(*pde));
-}
-
-
 static PTE *get_pt1(PDE *pde) {
     return (PTE *)P2V(pte_addr(*pde));
 }
 
 
-static PTE *get_pte(PD *page_dir, const void *vaddr) {
-    PTE *pt = get_pt(page_dir, vaddr);
-    return &pt[page_table_idx((uintptr_t)vaddr)];
-}
-
-
 static PTE *get_pte1(PDE *pde, const void *vaddr) {
     PTE *pt = get_pt1(pde);
     return &pt[page_table_idx((uintptr_t)vaddr)];
@@ -108,6 +106,9 @@ static PTE *walk(PD *page_dir, const void *vaddr) {
     PDE *pde = get_pde(page_dir, vaddr);
     PTE *pt;
 
+    if (*pde & PDE_PS)
+        panic("walk: large page");
+
     if (*pde & PDE_P)
         return get_pte1(pde, vaddr);
 
@@ -121,9 +122,25 @@ static PTE *walk(PD *page_dir, const void *vaddr) {
 }
 
 
+/*! Can [vstart, vend) start with a 4 MiB page (PSE)? Only for kernel
+ *  mappings, with both addresses aligned and no page table in the way.
+ * */
+static bool large_fits(PD *page_dir, const char *vstart, const char *vend,
+                       physical_addr pstart, int perm) {
+    return pse
+        && !(perm & PTE_U)
+        && (uintptr_t)vstart % LPAGE_SZ == 0
+        && pstart % LPAGE_SZ == 0
+        && (uintptr_t)(vend - vstart) >= LPAGE_SZ
+        && !(*get_pde(page_dir, vstart) & PDE_P);
+}
+
+
 /*! Create PTE for virtual addresses starting at vaddr mapped to paddr
  *  virtual address doesn't need to align on page boundry, `map_pages
- *  will automatically round down the address.
+ *  will automatically round down the address. Aligned 4 MiB runs of
+ *  the kernel map are mapped by a single large PDE, see `large_fits`.
+ *  Kernel pages are global, their TLB entries survive a process switch.
  *
  *  @return true if pages are mapped successfully. false otherwise.
  * */
@@ -132,6 +149,7 @@ static bool map_pages(PD *page_dir, const VMap *k) {
     char         *vstart = (char *)page_aligndown((uintptr_t)k->virt);
     char         *vend   = (char *)page_aligndown((uintptr_t)k->virt + size);
     physical_addr pstart = k->pstart;
+    int           perm   = k->perm | (pge && !(k->perm & PTE_U) ? PTE_G : 0);
     PTE *pte;
 
 #if DEBUG
@@ -143,29 +161,33 @@ static bool map_pages(PD *page_dir, const VMap *k) {
         panic("map_pages: not on page boundry");
 
     for (; vstart != vend; vstart+=PAGE_SZ, pstart+=PAGE_SZ) {
+        if (large_fits(page_dir, vstart, vend, pstart, k->perm)) {
+            *get_pde(page_dir, vstart) = pstart | PDE_P | PDE_PS | perm;
+            vstart += LPAGE_SZ - PAGE_SZ;
+            pstart += LPAGE_SZ - PAGE_SZ;
+            continue;
+        }
+
         if ((pte = walk(page_dir, vstart)) == 0)
             return false;
 
         if (*pte & PTE_P)
             panic("remap");
 
-        *pte = pstart | PTE_P | k->perm;
+        *pte = pstart | PTE_P | perm;
     }
     return true;
 }
 
 
-/*! Setup the kernel part of the page table. we allocate
- *  a single page to hold the PD. Then we map pages base
- *  on the `kmap` to setup the kernel virtual memory.
+/*! Build the kernel part of the page table. we allocate a single page
+ *  to hold the PD. Then we map pages base on the `kmap` to setup the
+ *  kernel virtual memory. This runs once, for `kernel_page_dir`.
  *
  *  @return initialized page directory
  * */
-PD *allocate_kernel_vmem() {
+static PD *build_kernel_vmem() {
     PD *page_dir;
-    if ((void *)P2V(PHYSTOP) > (void *)DEV_SPACE)
-        panic("PHYSTOP is too high");
-
     if ((page_dir = (PD*)palloc()) == 0)
         return 0;
 
@@ -174,28 +196,113 @@ PD *allocate_kernel_vmem() {
     int kmap_sz = sizeof(kmap) / sizeof(kmap[0]) ;
 
     for (VMap *k = kmap; k < &kmap[kmap_sz]; k++) {
-        if (!map_pages(page_dir, k)) {
-            free_vmem(page_dir);
-            return false;
+        if (!map_pages(page_dir, k))
+            panic("build_kernel_vmem: out of memory");
+    }
+    return page_dir;
+}
+
+
+/*! Map the physical memory [pstart, pend) in the direct map of the
+ *  kernel page table.
+ *  @return  false if a page table can't be allocated.
+ * */
+bool kernel_vmem_map(physical_addr pstart, physical_addr pend) {
+    VMap k =
+        { .virt   = P2V_C(pstart),
+          .pstart = pstart,
+          .pend   = pend,
+          .perm   = PTE_W
+        };
+    if (pend > DIRECTSTOP)
+        panic("kernel_vmem_map: past the direct map");
+    return map_pages(kernel_page_dir, &k);
+}
+
+
+/*! Map the page at `pa` in the kernel. A direct mapped page is mapped
+ *  already, a highmem page takes a slot of the kmap window until `kunmap_page`.
+ *  Slots are meant to be held shortly, we panic if there is none left.
+ *  @return  the virtual address of the page.
+ * */
+char *kmap_page(physical_addr pa) {
+    if (pa < phystop)
+        return (char *)P2V_C(pa);
+
+    for (unsigned i = 0; i < NPTES; ++i) {
+        if (kmap_pt[i] == 0) {
+            kmap_pt[i] = pa | PTE_P | PTE_W | (pge ? PTE_G : 0);
+            return (char *)KMAP_BASE + i * PAGE_SZ;
         }
     }
+    panic("kmap_page: no free slot");
+    return 0;
+}
+
+
+/*! Release the address of a page from `kmap_page` */
+void kunmap_page(char *v) {
+    if ((uintptr_t)v < KMAP_BASE)
+        return;
+    kmap_pt[((uintptr_t)v - KMAP_BASE) / PAGE_SZ] = 0;
+    invlpg(v);
+}
+
+
+/*! Allocate the page directory of a process. The kernel half is the
+ *  same for every process: its PDEs are copied from `kernel_page_dir`,
+ *  so the kernel page tables are shared and never freed.
+ *
+ *  @return page directory with an empty user half, 0 if failed.
+ * */
+PD *allocate_kernel_vmem() {
+    PD      *page_dir;
+    unsigned k = page_directory_idx(KERN_BASE);
+
+    if ((page_dir = (PD*)palloc()) == 0)
+        return 0;
+
+    memset(page_dir, 0, k * sizeof(PDE));
+    memmove(&page_dir[k], &kernel_page_dir[k], (NPDES - k) * sizeof(PDE));
     return page_dir;
 }
 
 
+/*! Load a page directory into cr3 unless it's already loaded. A load
+ *  flushes the TLB, the global kernel entries aside.
+ * */
+static void load_page_dir(PD *page_dir) {
+    push_cli();
+    if (this_cpu()->cr3 != V2P_C(page_dir)) {
+        this_cpu()->cr3 = V2P_C(page_dir);
+        set_cr3(V2P_C(page_dir));
+    }
+    pop_cli();
+}
+
+
 /*! Switch page table register cr3 to kernel only page table. This page table is used
  *  when there is no process running
  * */
-void switch_kernel_vmem() { set_cr3(V2P_C(kernel_page_dir)); }
+void switch_kernel_vmem() { load_page_dir(kernel_page_dir); }
 
 
 /*! Setup kernel virtual memory */
 void kernel_vmem_init() {
     vga_printf("[\033[32mboot\033[0m] kernel_vmem_alloc...");
+    uint32_t a, d;
+    cpuid(1, &a, &d);
+    if ((pse = d & CPUID_PSE))
+        set_cr4(get_cr4() | CR4_PSE);
+    if ((pge = d & CPUID_PGE))
+        set_cr4(get_cr4() | CR4_PGE);
     init_kmap();
-    if ((kernel_page_dir = allocate_kernel_vmem()) == 0) {
+    if ((kernel_page_dir = build_kernel_vmem()) == 0) {
         panic("kernel_vmem_init");
     }
+    if ((kmap_pt = walk(kernel_page_dir, (void *)KMAP_BASE)) == 0) {
+        panic("kernel_vmem_init: kmap");
+    }
     switch_kernel_vmem();
     vga_printf("\033[32mok\033[0m\n");
 }
@@ -227,26 +334,9 @@ void init_user_vmem(PD *page_dir, char *init, size_t sz) {
 }
 
 
-/* Write TSS segment for user space task switching */
-static void write_tss(Process *p) {
-    push_cli();
-    uint16_t flag  = SEG_S(0)       | SEG_P(1)  | SEG_AVL(0) |
-                     SEG_L(0)       | SEG_DB(1) | SEG_G(0)   |
-                     SEG_DPL(DPL_K) | SEG_TSS_32_AVL;
-    uint32_t base  = (uintptr_t)&this_cpu()->ts;
-    uint32_t limit = sizeof(this_cpu()->ts) - 1;
-    uint8_t  rpl   = 0; // request privilege level
-    memset((void*)base, 0, limit);
-    this_cpu()->gdt[SEG_TSS] = create_descriptor(base, limit, flag);
-    this_cpu()->ts.ss0       = SEG_KDATA << 3;
-    this_cpu()->ts.esp0      = (uintptr_t)p->kstack + KSTACK_SZ;
-    ltr(SEG_TSS << 3 | rpl);
-    pop_cli();
-}
-
-
-/*! Switch TSS and page table to process `p`.
- *  We setup a new TSS entry for the gdt. When interrupt occurs,
+/*! Switch to process `p`: point the TSS at its kernel stack, and load
+ *  its page table if it's not the loaded one. The TSS itself is set up
+ *  once, see `gdt_init`.
  * */
 void switch_user_vmem(Process *p) {
     if (!p)
@@ -257,42 +347,45 @@ void switch_user_vmem(Process *p) {
         panic("switch_user_vmem: no page table");
 
     push_cli();
-    write_tss(p); // setup TSS
-    set_cr3(V2P_C(this_proc()->pgdir));
+    this_cpu()->ts.esp0 = (uintptr_t)p->kstack + KSTACK_SZ;
+    load_page_dir(p->pgdir);
     pop_cli();
 }
 
 
 /* !Grow process virtual memory from oldsz to newsz, which need not be page
- * aligned. Returns new size or 0 on error.
+ * aligned. The heap ends below the file mappings at MMAP_BASE.
+ * Returns new size or 0 on error.
  * */
 int allocate_user_vmem(PD *page_dir, size_t oldsz, size_t newsz) {
-    if (newsz > KERN_BASE)
+    if (newsz > MMAP_BASE)
         return 0;
 
     if (newsz < oldsz)
         return oldsz;
 
     for (uintptr_t p = page_alignup(oldsz); p < newsz; p += PAGE_SZ) {
-        char *mem;
-        if ((mem = palloc()) == 0) {
+        physical_addr pa;
+        if ((pa = palloc_phys()) == 0) {
             perror("allocate_user_vmem: out of memory");
             deallocate_user_vmem(page_dir, newsz, oldsz);
             return 0;
         }
 
+        char *mem = kmap_page(pa);
         memset(mem, 0, PAGE_SZ);
+        kunmap_page(mem);
         VMap mmap =
             { .virt   = (char *)p,
-              .pstart = V2P_C(mem),
-              .pend   = V2P_C(mem + PAGE_SZ),
+              .pstart = pa,
+              .pend   = pa + PAGE_SZ,
               .perm   = PTE_W | PTE_U
             };
 
         if (!map_pages(page_dir, &mmap)) {
             perror("allocate_user_vmem: out of memory");
             deallocate_user_vmem(page_dir, newsz, oldsz);
-            pfree(mem);
+            pfree_phys(pa);
             return 0;
         }
     }
@@ -300,52 +393,105 @@ int allocate_user_vmem(PD *page_dir, size_t oldsz, size_t newsz) {
 }
 
 
-/*! Copy the page table of another process.
- *  @page_dir   the page directory of process to copy from.
- *  @sz         number of pages copy from the other process.
+/*! Return the PTE of a user page, 0 if its page table doesn't exist */
+PTE *find_user_pte(PD *page_dir, const void *vaddr) {
+    PDE *pde = get_pde(page_dir, vaddr);
+    return *pde & PDE_P ? get_pte1(pde, vaddr) : 0;
+}
+
+
+/*! Map the user page at `vaddr` to the physical page `pa`, an old
+ *  mapping is replaced.
+ *  @return  false if the page table can't be allocated.
+ * */
+bool map_user_page(PD *page_dir, const void *vaddr, physical_addr pa, int perm) {
+    PTE *pte;
+    if ((pte = walk(page_dir, vaddr)) == 0)
+        return false;
+    *pte = pa | PTE_P | perm;
+    invlpg(vaddr);
+    return true;
+}
+
+
+/*! Remove the mapping of the user page at `vaddr`.
+ *  @return  the old PTE, 0 if the page was not mapped.
+ * */
+PTE unmap_user_page(PD *page_dir, const void *vaddr) {
+    PTE *pte = find_user_pte(page_dir, vaddr);
+    PTE  old;
+    if (!pte || !(*pte & PTE_P))
+        return 0;
+    old  = *pte;
+    *pte = 0;
+    invlpg(vaddr);
+    return old;
+}
+
+
+/*! Copy the user memory of another process, copy on write. The
+ *  writable pages become read only PTE_COW pages shared by both page
+ *  tables, each with one more reference. The first write gives the
+ *  writer its own copy, see `cow_fault`.
+ *  @page_dir   the page directory of the current process.
+ *  @sz         number of bytes copy from the other process.
  *  @return     the copied page directory. 0 if failed.
  * */
-PD * copy_user_vmem(PD *page_dir, size_t sz) {
-    char *mem;
+PD *copy_user_vmem(PD *page_dir, size_t sz) {
     PD *new_pgdir;
 
     if ((new_pgdir = allocate_kernel_vmem()) == 0)
-        return false;
-
-    PTE *pte;
-
-    for (size_t i = 0; i < sz; i+=PAGE_SZ) {
-        if ((pte = get_pte(page_dir, (void*)i)) == 0)
-            panic("copy_user_vmem: trying to copy non existing pte");
+        return 0;
 
-        if (!(*pte & PTE_P))
+    for (size_t i = 0; i < sz; i += PAGE_SZ) {
+        PTE *pte = find_user_pte(page_dir, (void *)i);
+        if (!pte || !(*pte & PTE_P))
             panic("copy_user_vmem: page not present");
 
-        physical_addr pa = pte_addr(*pte);
-        unsigned flags   = pte_flags(*pte);
-
-        if ((mem = palloc()) == 0) {
-            free_vmem(new_pgdir);
-            return 0;
+        if (*pte & PTE_W) {
+            *pte = (*pte & ~PTE_W) | PTE_COW;
+            invlpg((void *)i);
         }
 
-        memmove(mem, (char *)P2V_C(pa), PAGE_SZ);
-
-        VMap mmap =
-            { .virt   = (char *)i,
-              .pstart = V2P_C(mem),
-              .pend   = V2P_C(mem + PAGE_SZ),
-              .perm   = flags
-            };
-        if (!map_pages(new_pgdir, &mmap)) {
+        physical_addr pa = pte_addr(*pte);
+        if (!map_user_page(new_pgdir, (void *)i, pa, pte_flags(*pte) & ~PTE_P)) {
             free_vmem(new_pgdir);
             return 0;
         }
+        pdup(pa);
     }
     return new_pgdir;
 }
 
 
+/*! Give the current process its own copy of a PTE_COW page on a write
+ *  fault. The last process that shares the page just gets it writable.
+ *  @return  false if `vaddr` is not a copy on write page, or there is no
+ *           memory for the copy.
+ * */
+bool cow_fault(PD *page_dir, const void *vaddr) {
+    PTE *pte = find_user_pte(page_dir, vaddr);
+    if (!pte || (*pte & (PTE_P | PTE_COW)) != (PTE_P | PTE_COW))
+        return false;
+
+    physical_addr pa   = pte_addr(*pte);
+    int           perm = (pte_flags(*pte) & ~(PTE_P | PTE_COW)) | PTE_W;
+    if (prefs(pa) > 1) {
+        physical_addr copy;
+        if ((copy = palloc_phys()) == 0)
+            return false;
+        char *dst = kmap_page(copy);
+        char *src = kmap_page(pa);
+        memmove(dst, src, PAGE_SZ);
+        kunmap_page(src);
+        kunmap_page(dst);
+        pfree_phys(pa); // drop our reference
+        pa = copy;
+    }
+    return map_user_page(page_dir, (void *)page_aligndown((uintptr_t)vaddr), pa, perm);
+}
+
+
 /* !Shrink process virtual memory from oldsz to newsz, which need not be page
  * aligned. Returns new size.
  * */
@@ -354,17 +500,17 @@ int deallocate_user_vmem(PD *page_dir, uintptr_t oldsz, uintptr_t newsz) {
         return oldsz;
 
     for (uintptr_t p = page_alignup(newsz); p < oldsz; p += PAGE_SZ) {
-        PTE *pte = get_pte(page_dir, (char *)p);
+        PTE *pte = find_user_pte(page_dir, (char *)p);
 
-        if (!pte)
+        if (!pte) { // no page table, skip to the next one
             p = page_addr(page_directory_idx(p) + 1, 0, 0) - PAGE_SZ;
+            continue;
+        }
 
         if (*pte & PTE_P) {
-            physical_addr page_table_addr = page_table_idx(*pte);
-            if (page_table_addr == 0)
-                panic("deallocate_user_vmem: trying to pfree invalid physical addr");
-            pfree(P2V_C(page_table_addr));
-            continue;
+            pfree_phys(pte_addr(*pte)); // a shared page loses a reference
+            *pte = 0;
+            invlpg((void *)p);
         }
     }
     return newsz;
@@ -372,15 +518,20 @@ int deallocate_user_vmem(PD *page_dir, uintptr_t oldsz, uintptr_t newsz) {
 
 
 /*! Free a page table.
- *  This will free all memory used in the user part.
+ *  This will free all memory used in the user part. The kernel page
+ *  tables are shared, see `allocate_kernel_vmem`.
  * */
 void free_vmem(PD *page_dir) {
     if (page_dir == 0)
         panic("free_vmem");
+    if (page_dir == kernel_page_dir)
+        panic("free_vmem: kernel page directory");
+    if (this_cpu()->cr3 == V2P_C(page_dir)) // still loaded since its last run
+        switch_kernel_vmem();
 
     // deallocate
     deallocate_user_vmem(page_dir, KERN_BASE, 0);
-    for (int i = 0; i < NPDES; ++i) {
+    for (unsigned i = 0; i < page_directory_idx(KERN_BASE); ++i) {
         if (page_dir[i] & PDE_P) {
             pfree((char *)P2V(pte_addr(page_dir[i])));
         }
@@ -13,12 +13,19 @@ typedef struct VMap {
 } VMap;
 
 
-void kernel_vmem_init();
-PD  *allocate_kernel_vmem();
-void switch_kernel_vmem();
-int  allocate_user_vmem(PD *page_dir, size_t oldsz, size_t newsz);
-int  deallocate_user_vmem(PD *page_dir, size_t oldsz, size_t newsz);
-void switch_user_vmem(Process *p);
-PD  *copy_user_vmem(PD *page_dir, size_t sz);
-void init_user_vmem(PD *page_dir, char *init, size_t sz);
-void free_vmem(PD *);
+void  kernel_vmem_init();
+bool  kernel_vmem_map(physical_addr pstart, physical_addr pend);
+char *kmap_page(physical_addr pa);
+void  kunmap_page(char *v);
+PD   *allocate_kernel_vmem();
+void  switch_kernel_vmem();
+int   allocate_user_vmem(PD *page_dir, size_t oldsz, size_t newsz);
+int   deallocate_user_vmem(PD *page_dir, size_t oldsz, size_t newsz);
+void  switch_user_vmem(Process *p);
+PD   *copy_user_vmem(PD *page_dir, size_t sz);
+PTE  *find_user_pte(PD *page_dir, const void *vaddr);
+bool  map_user_page(PD *page_dir, const void *vaddr, physical_addr pa, int perm);
+PTE   unmap_user_page(PD *page_dir, const void *vaddr);
+bool  cow_fault(PD *page_dir, const void *vaddr);
+void  init_user_vmem(PD *page_dir, char *init, size_t sz);
+void  free_vmem(PD *);
@@ -1,8 +1,11 @@
 #include "string.h"
 #include "err.h"
+#include "i386.h"
 #include "process.h"
 #include "process/proc.h"
 #include "process/pdefs.h"
+#include "trap/ncli.h"
+#include "memory/vma.h"
 #include "memory/vmem.h"
 #include "driver/vga.h"
 #include "fs/file.h"
@@ -13,9 +16,64 @@ extern PTable   ptable;
 extern Process *proc_init1;
 
 
+#define SCHED_BENCH 0 // run the context switch benchmark at boot
+
+
+#if SCHED_BENCH
+#define NBENCH 10000 // rounds of the ping-pong
+
+
+static struct {
+    SpinLock lk;
+    int      turn;   // 0 = ping, 1 = pong
+    unsigned rounds;
+} bench;
+
+
+/*! One side of the ping-pong: wait for its turn, pass it on. Every round
+ *  is two context switches between the two threads.
+ * */
+static void bench_side(int me) {
+    SchedStat s0, s1;
+    uint64_t  t0 = rdtsc();
+
+    sched_stat(&s0);
+    lock(&bench.lk);
+    while (bench.rounds < NBENCH) {
+        while (bench.turn != me && bench.rounds < NBENCH)
+            sleep(&bench, &bench.lk);
+        bench.turn    = !me;
+        bench.rounds += me;
+        wakeup(&bench);
+    }
+    unlock(&bench.lk);
+    sched_stat(&s1);
+
+    if (me == 0) {
+        unsigned n = s1.nswitch - s0.nswitch;
+        vga_printf("[\033[32mbench\033[0m] ping-pong: %d rounds, %d cycles/round, %d cycles/switch\n",
+                   NBENCH, (unsigned)((rdtsc() - t0) / NBENCH),
+                   n ? (unsigned)((s1.cycles - s0.cycles) / n) : 0);
+    }
+    lock(&bench.lk);
+    for (;;)
+        sleep(&bench.rounds, &bench.lk);
+}
+
+
+static void bench_ping() { bench_side(0); }
+static void bench_pong() { bench_side(1); }
+#endif
+
+
 void process_init() {
     ptable_init();
     init_pid1();
+#if SCHED_BENCH
+    bench.lk = new_lock("bench.lk");
+    kthread_create("ping", bench_ping);
+    kthread_create("pong", bench_pong);
+#endif
 }
 
 
@@ -47,7 +105,7 @@ int fork() {
     *child->trapframe     = *thisp->trapframe;
     child->trapframe->eax = 0;
 
-    for (int i = 0; i < NFILE; ++i) {
+    for (int i = 0; i < NOFILE; ++i) {
         File *f = thisp->file[i];
         if (f) {
             child->file[i] = file_dup(f);
@@ -74,6 +132,8 @@ void exit() {
     if (thisp == proc_init1)
         panic("init 1 is exiting");
 
+    vma_unmap(thisp, MMAP_BASE, KERN_BASE); // writes back shared pages
+
     lock(&ptable.lk);
 
     wakeup_unlocked(thisp->parent);
@@ -144,8 +204,24 @@ void sched() {
         panic("sched: interruptible");
 
     int int_on = this_cpu()->int_on;
+    this_cpu()->swstart = rdtsc();
     swtch(&p->context, this_cpu()->scheduler);
     this_cpu()->int_on = int_on;
+    this_cpu()->nswitch++; // from the process that left to this one
+    this_cpu()->swcycles += rdtsc() - this_cpu()->swstart;
+}
+
+
+/*! Get the context switch counters. A switch is timed from the `sched`
+ *  of the process that gives up the CPU until the next process returns
+ *  from its own `sched`, the scheduler loop and address space switches
+ *  included.
+ * */
+void sched_stat(SchedStat *st) {
+    push_cli();
+    st->nswitch = this_cpu()->nswitch;
+    st->cycles  = this_cpu()->swcycles;
+    pop_cli();
 }
 
 
@@ -216,7 +292,9 @@ void yield() {
 /*! The scheduler next returns. CPU loops over the `ptable` and look
  *  for the next process to run. The loop will pick the first ready
  *  process, switch to run the process, wait until the process switch
- *  back to the scheduler.
+ *  back to the scheduler. The scheduler runs on the page table of the
+ *  last process, its kernel half is the same everywhere, so cr3 is only
+ *  loaded when the next process has a different one.
  * */
 void scheduler() {
     vga_printf("[\033[32mboot\033[0m] scheduler...\n");
@@ -232,7 +310,6 @@ void scheduler() {
             switch_user_vmem(p);
             p->state = PROC_RUNNING;
             swtch(&cpu->scheduler, p->context);
-            switch_kernel_vmem();
             cpu->proc = 0;
         }
         unlock(&ptable.lk);
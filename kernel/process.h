@@ -1,4 +1,5 @@
 #pragma once
+#include "process/pdefs.h"
 #include "process/spinlock.h"
 
 
@@ -12,6 +13,7 @@ void     wakeup_unlocked(void *chan);
 void     wakeup(void *chan);
 void     yield();
 void     sched();
+void     sched_stat(SchedStat *st);
 CPU     *this_cpu();
 Process *this_proc();
 void     scheduler();
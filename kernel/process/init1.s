@@ -1,13 +1,136 @@
 #include "trap/traps.h"
 #include "sys/syscalls.h"
 
+;; The first user process. It checks the file system system calls, then
+;; spins. A failed check reads FAILBASE + its number: the kernel reports
+;; the page fault ("page fault at 0xbad00N", N in hex) on the debug port
+;; and kills the process.
+;;
+;; The code is linked into the kernel image but runs at address 0, data
+;; is addressed from `base` (ebx), never by its link address.
+
+%define O_RDONLY    0x000   ; see melon/sys.h
+%define O_RDWR      0x002
+%define O_CREATE    0x200
+%define PROT_READ   0x1
+%define PROT_WRITE  0x2
+%define MAP_SHARED  0x1
+%define DIRENT_NAME 10      ; offset of the name in a Dirent record
+%define BUFSZ       128
+%define DATASZ      16      ; length of `data`
+%define MAPSZ       4096
+%define FAILBASE    0xbad000
+
+;; System call: the number, then the arguments. They are pushed right
+;; to left and the call goes through `sys` like a libmelon stub, so the
+;; kernel finds them above a return address.
+%macro SYS 1-*
+    %rep %0 - 1
+        %rotate -1
+        push %1
+    %endrep
+    %rotate -1
+    mov eax, %1
+    call sys
+    add esp, (%0 - 1) << 2
+%endmacro
+
+;; Fail check %2 if the flags satisfy the condition jump %1
+%macro FAILIF 2
+    %1 %%fail
+    jmp %%ok
+%%fail:
+    mov eax, [FAILBASE + %2]
+%%ok:
+%endmacro
+
 section .init1
 
 global init1
 init1:
+    call base
+base:
+    pop ebx
+
     mov eax, SYS_GETPID
     int I_SYSCALL
-loop: jmp loop
 
-msg:
-    db "init1", 0
+    ;; getdents: create /hello and read it back from the root directory
+    lea ecx, [ebx + hello - base]
+    SYS SYS_OPEN, ecx, O_CREATE | O_RDWR
+    cmp eax, 0
+    FAILIF jl, 1
+    lea ecx, [ebx + root - base]
+    SYS SYS_OPEN, ecx, O_RDONLY
+    cmp eax, 0
+    FAILIF jl, 2
+    mov esi, eax
+    sub esp, BUFSZ
+    mov edx, esp
+    SYS SYS_GETDENTS, esi, edx, BUFSZ
+    cmp eax, DIRENT_NAME
+    FAILIF jle, 3
+    lea esi, [esp + DIRENT_NAME]       ; name of the first record
+    lea edi, [ebx + hello + 1 - base]  ; "hello"
+    mov ecx, 6
+    repe cmpsb
+    FAILIF jne, 4
+    add esp, BUFSZ
+
+    ;; mmap: write /mm, change it through a shared mapping, and read it
+    ;; back after munmap
+    lea ecx, [ebx + mm - base]
+    SYS SYS_OPEN, ecx, O_CREATE | O_RDWR
+    cmp eax, 0
+    FAILIF jl, 5
+    mov esi, eax
+    lea ecx, [ebx + data - base]
+    SYS SYS_WRITE, esi, ecx, DATASZ
+    cmp eax, DATASZ
+    FAILIF jne, 6
+    SYS SYS_MMAP, 0, MAPSZ, PROT_READ | PROT_WRITE, MAP_SHARED, esi, 0
+    cmp eax, -1
+    FAILIF je, 7
+    mov edx, eax
+    mov esi, edx
+    lea edi, [ebx + data - base]
+    mov ecx, DATASZ
+    repe cmpsb
+    FAILIF jne, 8
+    mov byte [edx], 'X'
+    SYS SYS_MUNMAP, edx, MAPSZ
+    cmp eax, 0
+    FAILIF jne, 9
+    lea ecx, [ebx + mm - base]
+    SYS SYS_OPEN, ecx, O_RDONLY
+    cmp eax, 0
+    FAILIF jl, 10
+    mov esi, eax
+    sub esp, BUFSZ
+    mov edx, esp
+    SYS SYS_READ, esi, edx, BUFSZ
+    cmp eax, DATASZ
+    FAILIF jne, 11
+    cmp byte [esp], 'X'
+    FAILIF jne, 12
+    lea esi, [esp + 1]
+    lea edi, [ebx + data + 1 - base]
+    mov ecx, DATASZ - 1
+    repe cmpsb
+    FAILIF jne, 13
+    add esp, BUFSZ
+
+spin: jmp spin
+
+sys:
+    int I_SYSCALL
+    ret
+
+root:
+    db "/", 0
+hello:
+    db "/hello", 0
+mm:
+    db "/mm", 0
+data:
+    db "0123456789abcdef"
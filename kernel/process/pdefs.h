@@ -35,6 +35,24 @@ typedef struct Context {
 } Context;
 
 
+/* mmap protection and flags */
+#define PROT_READ   0x1
+#define PROT_WRITE  0x2
+#define MAP_SHARED  0x1 // writes reach the file
+#define MAP_PRIVATE 0x2 // writes go to a private copy of the page
+
+
+/* A file mapping in [start, end), see memory/vma.c */
+typedef struct VMArea {
+    uintptr_t start; // page aligned, 0 if the slot is free
+    uintptr_t end;
+    File     *f;
+    offset_t  off;   // file offset of start, page aligned
+    int       prot;
+    int       flags;
+} VMArea;
+
+
 typedef struct Process {
     uint32_t        size;         // size of process memory
     PD             *pgdir;        // per process page table
@@ -47,7 +65,9 @@ typedef struct Process {
     void           *chan;         // sleep on chan if it's not zero
     bool            killed;       // is process killed
     File           *file[NOFILE]; // files
+    VMArea          vma[NVMA];    // file mappings
     char            name[16];     // name of the process
+    void          (*kmain)();     // entry of a kernel thread, 0 for user process
 } Process;
 
 
@@ -61,4 +81,15 @@ typedef struct CPU {
     bool          int_on; // was int enabled when ncli = 0
     int           ncli;   // levels of pushcli
     Process     *proc;
+    uintptr_t     cr3;      // physical address of the loaded page directory
+    uint64_t      swstart;  // rdtsc when the last process entered `sched`
+    unsigned      nswitch;  // number of process switches
+    uint64_t      swcycles; // cycles from `sched` to the next process
 } CPU;
+
+
+/* Context switch counters, see `sched` */
+typedef struct SchedStat {
+    unsigned nswitch;
+    uint64_t cycles;
+} SchedStat;
@@ -21,6 +21,7 @@ PTable   ptable;
 int      nextpid = 1;
 Process *proc_init1;
 CPU      cpu;
+extern PD  *kernel_page_dir;
 extern void trapret();
 extern void swtch(Context **save, Context *load);
 
@@ -189,10 +190,10 @@ Process *allocate_process() {
 void deallocate_process(Process *p) {
     lock(&ptable.lk);
     p->size = 0;
-    if (p->pgdir) {
+    if (p->pgdir && p->pgdir != kernel_page_dir) {
         free_vmem(p->pgdir);
-        p->pgdir = 0;
     }
+    p->pgdir = 0;
     if (p->kstack)  {
         pfree(p->kstack);
         p->kstack = 0;
@@ -205,6 +206,7 @@ void deallocate_process(Process *p) {
     p->context   = 0;
     p->chan      = 0;
     p->killed    = 0;
+    p->kmain     = 0;
     memset(p->name, 0, sizeof(p->name));
     unlock(&ptable.lk);
 }
@@ -255,6 +257,39 @@ void init_pid1() {
 }
 
 
+/*! Entry of a kernel thread. The scheduler switches in with ptable.lk
+ *  held, release it before running the thread. A kernel thread never
+ *  returns.
+ * */
+static void kthread_start() {
+    unlock(&ptable.lk);
+    this_proc()->kmain();
+    panic("kthread_start: kernel thread returned");
+}
+
+
+/*! Create a process that runs `fn` in the kernel. It has no user memory,
+ *  it runs on `kernel_page_dir` so switching to it doesn't load cr3.
+ *  @return  the new process. 0 if failed.
+ * */
+Process *kthread_create(const char *name, void (*fn)()) {
+    Process *p;
+    if ((p = allocate_process()) == 0)
+        return 0;
+
+    p->pgdir        = kernel_page_dir;
+    p->context->eip = (uint32_t)kthread_start;
+    p->kmain        = fn;
+    p->parent       = proc_init1;
+    strncpy(p->name, name, sizeof(p->name));
+
+    lock(&ptable.lk);
+    p->state = PROC_READY;
+    unlock(&ptable.lk);
+    return p;
+}
+
+
 /*! Grow process user memory by n bytes, n can be negative.
  * */
 bool grow_process(int n) {
@@ -16,3 +16,4 @@ CPU     *this_cpu();
 Process *this_proc();
 Process *allocate_process();
 void     deallocate_process(Process *p);
+Process *kthread_create(const char *name, void (*fn)());
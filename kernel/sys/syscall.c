@@ -1,11 +1,14 @@
 #include <stdint.h>
 #include <string.h>
 #include "err.h"
+#include "fs.h"
 #include "file.h"
 #include "pdefs.h"
 #include "process.h"
 #include "sys/syscall.h"
 #include "sys/syscalls.h"
+#include "memory/palloc.h"
+#include "memory/vma.h"
 
 /* Copying system call arguments from user stack to
  *
@@ -26,43 +29,58 @@
  * */
 
 
+/*! Is [addr, addr + len) in the memory of the process? The kernel only
+ *  copies from and to user buffers below `size`, where every page is
+ *  mapped. Mapped files are not accepted: a page past the end of the
+ *  file or a read only mapping would fault in the kernel.
+ * */
+static bool user_range(const void *addr, size_t len) {
+    uintptr_t a  = (uintptr_t)addr;
+    uint32_t  sz = this_proc()->size;
+    return a < sz && len <= sz - a;
+}
+
+
+/*! Is `s` a nul terminated string in the memory of the process? */
+static bool user_str(const char *s) {
+    uintptr_t a  = (uintptr_t)s;
+    uint32_t  sz = this_proc()->size;
+    return a < sz && strnlen(s, sz - a) < sz - a;
+}
+
+
 /*! Get arguments from user stack.
  *  @nth    the nth argument, starts from 1.
- *  @args   type of arguments
+ *  @args   type of arguments, every one takes a word on the stack
  *            p: pointer
  *            d: int
  *            c: char
  *  @return the pointer points to the nth argument
  * */
 void *getarg(size_t nth, char *args) {
-    if (strlen(args) == 0) {
-        panic("getarg");
-    }
-
-    if (nth >= strlen(args))
+    if (nth == 0 || nth > strlen(args))
         panic("getarg");
 
     Process *thisp = this_proc();
     void *esp = (void*)thisp->trapframe->esp;
-    int offset = 4;
+    int offset = 4; // return address of the system call stub
 
-    while(nth) {
+    for (size_t i = 1; i < nth; ++i) { // skip the arguments before nth
         switch (*args++) {
             case 'p':
                 offset += sizeof(uintptr_t);
                 break;
             case 'd':
+            case 'c': // promoted to int
                 offset += sizeof(int);
                 break;
-            case 'c':
-                offset += sizeof(char);
-                break;
             default:
                 panic("getarg: unknown arg type");
         }
-        nth--;
     }
 
+    if (!user_range(esp + offset, sizeof(int))) // the stack is gone
+        exit();
     return esp + offset;
 }
 
@@ -76,6 +94,14 @@ void *getptr(size_t nth, char *args) { return *(void **)getarg(nth, args); }
 char getchr(size_t nth, char *args) { return *(char *)getarg(nth, args); }
 
 
+/*! Get the open file of fd, 0 if fd is not valid */
+static File *getfile(int fd) {
+    if (fd < 0 || fd >= NOFILE)
+        return 0;
+    return this_proc()->file[fd];
+}
+
+
 int sys_fork() {
     return fork();
 }
@@ -107,8 +133,11 @@ int sys_read() {
     int          fd   = getint(1, args);
     char        *buf  = (void *)getptr(2, args);
     int          sz   = getint(3, args);
-    Process     *p    = this_proc();
-    File        *f    = p->file[fd];
+    File        *f;
+    if ((f = getfile(fd)) == 0)
+        return -1;
+    if (sz < 0 || !user_range(buf, sz))
+        return -1;
     return file_read(f, buf, sz);
 }
 
@@ -118,20 +147,217 @@ int sys_write() {
     int          fd   = getint(1, args);
     const void  *buf  = (const void *)getptr(2, args);
     int          sz   = getint(3, args);
-    Process     *p    = this_proc();
-    File        *f    = p->file[fd];
+    File        *f;
+    if ((f = getfile(fd)) == 0)
+        return -1;
+    if (sz < 0 || !user_range(buf, sz))
+        return -1;
     return file_write(f, buf, sz);
 }
 
 
+int sys_open() {
+    static char *args  = "pd";
+    char        *path  = (char *)getptr(1, args);
+    int          flags = getint(2, args);
+    Process     *p     = this_proc();
+    File        *f;
+    int          fd;
+    for (fd = 0; fd < NOFILE && p->file[fd]; ++fd);
+    if (fd == NOFILE || !user_str(path))
+        return -1;
+    if ((f = fs_open(path, flags)) == 0)
+        return -1;
+    p->file[fd] = f;
+    return fd;
+}
+
+
+int sys_getdents() {
+    static char *args = "dpd";
+    int          fd   = getint(1, args);
+    char        *buf  = (char *)getptr(2, args);
+    int          sz   = getint(3, args);
+    File        *f;
+    if ((f = getfile(fd)) == 0)
+        return -1;
+    if (sz < 0 || !user_range(buf, sz))
+        return -1;
+    return file_getdents(f, buf, sz);
+}
+
+
+int sys_fsync() {
+    static char *args = "d";
+    int          fd   = getint(1, args);
+    Process     *p    = this_proc();
+    File        *f;
+    if (fd < 0 || fd >= NOFILE || (f = p->file[fd]) == 0)
+        return -1;
+    return file_fsync(f, false);
+}
+
+
+int sys_fdatasync() {
+    static char *args = "d";
+    int          fd   = getint(1, args);
+    Process     *p    = this_proc();
+    File        *f;
+    if (fd < 0 || fd >= NOFILE || (f = p->file[fd]) == 0)
+        return -1;
+    return file_fsync(f, true);
+}
+
+
+int sys_sync() {
+    fs_sync();
+    return 0;
+}
+
+
+int sys_statfs() {
+    static char *args = "p";
+    StatFs      *st   = (StatFs *)getptr(1, args);
+    if (!user_range(st, sizeof(*st)))
+        return -1;
+    fs_statfs(st);
+    return 0;
+}
+
+
+int sys_ftruncate() {
+    static char *args = "dd";
+    int          fd   = getint(1, args);
+    int          sz   = getint(2, args);
+    Process     *p    = this_proc();
+    File        *f;
+    if (fd < 0 || fd >= NOFILE || (f = p->file[fd]) == 0)
+        return -1;
+    if (sz < 0)
+        return -1;
+    return file_truncate(f, sz);
+}
+
+
+int sys_unlink() {
+    static char *args = "p";
+    char        *path = (char *)getptr(1, args);
+    if (!user_str(path))
+        return -1;
+    return fs_unlink(path);
+}
+
+
+int sys_fallocate() {
+    static char *args = "ddd";
+    int          fd   = getint(1, args);
+    int          off  = getint(2, args);
+    int          len  = getint(3, args);
+    Process     *p    = this_proc();
+    File        *f;
+    if (fd < 0 || fd >= NOFILE || (f = p->file[fd]) == 0)
+        return -1;
+    if (off < 0 || len <= 0)
+        return -1;
+    return file_fallocate(f, off, len);
+}
+
+
+int sys_ioctl() {
+    static char *args = "ddd";
+    int          fd   = getint(1, args);
+    int          cmd  = getint(2, args);
+    int          arg  = getint(3, args);
+    File        *f, *src;
+    if ((f = getfile(fd)) == 0)
+        return -1;
+
+    switch (cmd) {
+    case FIOCLONE:
+        if ((src = getfile(arg)) == 0)
+            return -1;
+        return file_clone(f, src);
+    case FIOSETCOMP:
+        return file_setcomp(f, arg != 0);
+    }
+    return -1;
+}
+
+
+/*! Map a file, the kernel picks the address and ignores the hint.
+ *  @return  the start of the mapping, -1 if failed.
+ * */
+int sys_mmap() {
+    static char *args  = "pddddd";
+    int          len   = getint(2, args);
+    int          prot  = getint(3, args);
+    int          flags = getint(4, args);
+    int          fd    = getint(5, args);
+    int          off   = getint(6, args);
+    File        *f;
+    uintptr_t    va;
+    if ((f = getfile(fd)) == 0)
+        return -1;
+    if (len <= 0 || off < 0)
+        return -1;
+    if ((va = vma_map(this_proc(), f, off, len, prot, flags)) == 0)
+        return -1;
+    return va;
+}
+
+
+int sys_munmap() {
+    static char *args = "pd";
+    uintptr_t    addr = (uintptr_t)getptr(1, args);
+    int          len  = getint(2, args);
+    if (len <= 0 || addr < MMAP_BASE || addr >= KERN_BASE || KERN_BASE - addr < (unsigned)len)
+        return -1;
+    return vma_unmap(this_proc(), addr, addr + len);
+}
+
+
+int sys_schedstat() {
+    static char *args = "p";
+    SchedStat   *st   = (SchedStat *)getptr(1, args);
+    if (!user_range(st, sizeof(*st)))
+        return -1;
+    sched_stat(st);
+    return 0;
+}
+
+
+int sys_memstat() {
+    static char *args = "p";
+    MemStat     *st   = (MemStat *)getptr(1, args);
+    if (!user_range(st, sizeof(*st)))
+        return -1;
+    palloc_stat(st);
+    return 0;
+}
+
+
 static int (*system_calls[])() = {
-    [SYS_FORK]   = sys_fork,
-    [SYS_EXIT]   = sys_exit,
-    [SYS_EXEC]   = sys_exec,
-    [SYS_GETPID] = sys_getpid,
-    [SYS_SBRK]   = sys_sbrk,
-    [SYS_WRITE]  = sys_write,
-    [SYS_READ]   = sys_read,
+    [SYS_FORK]      = sys_fork,
+    [SYS_EXIT]      = sys_exit,
+    [SYS_EXEC]      = sys_exec,
+    [SYS_GETPID]    = sys_getpid,
+    [SYS_SBRK]      = sys_sbrk,
+    [SYS_WRITE]     = sys_write,
+    [SYS_READ]      = sys_read,
+    [SYS_GETDENTS]  = sys_getdents,
+    [SYS_FSYNC]     = sys_fsync,
+    [SYS_FDATASYNC] = sys_fdatasync,
+    [SYS_SYNC]      = sys_sync,
+    [SYS_STATFS]    = sys_statfs,
+    [SYS_FTRUNCATE] = sys_ftruncate,
+    [SYS_UNLINK]    = sys_unlink,
+    [SYS_FALLOCATE] = sys_fallocate,
+    [SYS_IOCTL]     = sys_ioctl,
+    [SYS_MMAP]      = sys_mmap,
+    [SYS_MUNMAP]    = sys_munmap,
+    [SYS_SCHEDSTAT] = sys_schedstat,
+    [SYS_MEMSTAT]   = sys_memstat,
+    [SYS_OPEN]      = sys_open,
 };
 
 
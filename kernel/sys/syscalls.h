@@ -1,9 +1,23 @@
 #pragma once
 
-#define SYS_FORK    1
-#define SYS_EXIT    2
-#define SYS_EXEC    3
-#define SYS_GETPID  4
-#define SYS_SBRK    5
-#define SYS_WRITE   6
-#define SYS_READ    7
+#define SYS_FORK      1
+#define SYS_EXIT      2
+#define SYS_EXEC      3
+#define SYS_GETPID    4
+#define SYS_SBRK      5
+#define SYS_WRITE     6
+#define SYS_READ      7
+#define SYS_GETDENTS  8
+#define SYS_FSYNC     9
+#define SYS_FDATASYNC 10
+#define SYS_SYNC      11
+#define SYS_STATFS    12
+#define SYS_FTRUNCATE 13
+#define SYS_UNLINK    14
+#define SYS_FALLOCATE 15
+#define SYS_IOCTL     16
+#define SYS_MMAP      17
+#define SYS_MUNMAP    18
+#define SYS_SCHEDSTAT 19
+#define SYS_MEMSTAT   20
+#define SYS_OPEN      21
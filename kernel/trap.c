@@ -2,12 +2,15 @@
 #include "console.h"
 #include "debug.h"
 #include "err.h"
+#include "i386.h"
 #include "mmu.h"
 #include "process.h"
 #include "sys/syscall.h"
 #include "driver/kbd.h"
 #include "driver/pic.h"
 #include "fs/disk.h"
+#include "memory/vma.h"
+#include "memory/vmem.h"
 #include "trap/idt.h"
 #include "trap/traps.h"
 
@@ -50,6 +53,10 @@ void trap_init() {
                 vectors[i],
                 GATE_P(1) | GATE_DPL(DPL_K) | INT_GATE);
     }
+    regist_idt_handler( // may sleep on file IO, keep interrupts on
+            I_PGFLT,
+            vectors[I_PGFLT],
+            GATE_P(1) | GATE_DPL(DPL_K) | TRAP_GATE);
     regist_idt_handler(
             I_SYSCALL,
             vectors[I_SYSCALL],
@@ -81,8 +88,37 @@ void handle_syscall(TrapFrame *tf) {
 }
 
 
+/*! A write to a page shared since fork copies it, see `cow_fault`. A
+ *  page fault in a file mapping is filled from the page cache, see
+ *  `vma_fault`. Any other fault kills a user process, the kernel only
+ *  faults on user pages.
+ * */
+void handle_I_PGFLT(TrapFrame *tf) {
+    uintptr_t va   = rcr2();
+    Process  *p    = this_proc();
+    bool      user = (tf->cs & 3) == DPL_U;
+    bool      cow  = (tf->err & (FEC_PR | FEC_WR)) == (FEC_PR | FEC_WR);
+
+    if (p && va < KERN_BASE && cow && cow_fault(p->pgdir, (void *)va))
+        return;
+    if (p && va < KERN_BASE && vma_fault(p, va, tf->err))
+        return;
+    if (!user) {
+#if DEBUG
+        dump_trapframe(tf);
+#endif
+        panic("page fault in kernel");
+    }
+
+    debug_printf("pid %d: page fault at %#x, eip %#x\n", p->pid, va, tf->eip);
+    p->killed = true;
+    exit();
+}
+
+
 void handle_I_IRQ_TIMER() {
     ticks++;
+    wakeup(&ticks);
     pic_eoi();
 }
 
@@ -149,6 +185,9 @@ void trap(TrapFrame *tf) {
         case I_SYSCALL:
             handle_syscall(tf);
             break;
+        case I_PGFLT:
+            handle_I_PGFLT(tf);
+            break;
         case MAP_IRQ(I_IRQ_TIMER):
             handle_I_IRQ_TIMER();
             break;
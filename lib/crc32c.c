@@ -0,0 +1,78 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "crc32c.h"
+
+/* CRC32C (Castagnoli), slicing-by-8.
+ *
+ * The classic table driven CRC consumes one byte per table lookup, and
+ * each lookup depends on the previous one. Slicing-by-8 keeps 8 tables,
+ * `table[k][b]` is the CRC of byte `b` followed by k zero bytes. Eight
+ * input bytes are folded with eight independent lookups that are XORed
+ * together, so the CPU can overlap the loads.
+ *
+ * `crc32c_init` needs to be called once before `crc32c`.
+ * */
+
+#define CRC32C_POLY 0x82f63b78 // reflected 0x1edc6f41
+
+
+static uint32_t table[8][256];
+
+
+/*! Build the lookup tables */
+void crc32c_init() {
+    for (unsigned i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k)
+            c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        table[0][i] = c;
+    }
+
+    for (unsigned i = 0; i < 256; ++i) {
+        uint32_t c = table[0][i];
+        for (int k = 1; k < 8; ++k) {
+            c           = table[0][c & 0xff] ^ (c >> 8);
+            table[k][i] = c;
+        }
+    }
+}
+
+
+/*! Load a little endian 32 bits word */
+static inline uint32_t load32(const unsigned char *p) {
+    return (uint32_t)p[0]
+        | ((uint32_t)p[1] << 8)
+        | ((uint32_t)p[2] << 16)
+        | ((uint32_t)p[3] << 24);
+}
+
+
+/*! Update `crc` with `n` bytes from `buf`. Start with `crc` 0.
+ *  crc32c(0, "123456789", 9) is 0xe3069283.
+ * */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t n) {
+    const unsigned char *p = buf;
+    crc = ~crc;
+
+    // align to 8 bytes
+    for (; n && ((uintptr_t)p & 7); --n)
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    for (; n >= 8; n -= 8, p += 8) {
+        uint32_t lo = load32(p) ^ crc;
+        uint32_t hi = load32(p + 4);
+        crc = table[7][lo & 0xff]
+            ^ table[6][(lo >> 8) & 0xff]
+            ^ table[5][(lo >> 16) & 0xff]
+            ^ table[4][lo >> 24]
+            ^ table[3][hi & 0xff]
+            ^ table[2][(hi >> 8) & 0xff]
+            ^ table[1][(hi >> 16) & 0xff]
+            ^ table[0][hi >> 24];
+    }
+
+    while (n--)
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+    return ~crc;
+}
@@ -0,0 +1,7 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+
+void     crc32c_init();
+uint32_t crc32c(uint32_t crc, const void *buf, size_t n);
@@ -0,0 +1,183 @@
+#include <stddef.h>
+#include <stdint.h>
+#include "lz4.h"
+
+/* LZ4 block format codec.
+ *
+ * A block is a list of sequences. Each sequence is a token byte, the
+ * literal length high nibble and the match length low nibble, followed
+ * by the literals, a 2 byte little endian match offset and the length
+ * extensions (255 means more bytes follow). The last sequence only has
+ * literals. A match is at least 4 bytes long.
+ *
+ * The compressor is the greedy single probe variant: the hash of the
+ * next 4 bytes indexes a table of the last position they were seen at.
+ * It doesn't allocate, the caller passes the LZ4_HTSIZE entries table.
+ * Input positions are kept in 16 bits, so a block is at most LZ4_MAXIN
+ * bytes.
+ * */
+
+#define MINMATCH     4
+#define LASTLITERALS 5  // the last 5 bytes are always literals
+#define MFLIMIT      12 // no match starts in the last 12 bytes
+
+
+static inline uint32_t read32(const uint8_t *p) {
+    return (uint32_t)p[0]
+        | ((uint32_t)p[1] << 8)
+        | ((uint32_t)p[2] << 16)
+        | ((uint32_t)p[3] << 24);
+}
+
+
+static inline unsigned hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ4_HASHLOG);
+}
+
+
+/*! Write a length extension, `len` is what's left after the nibble */
+static uint8_t *put_len(uint8_t *op, unsigned len) {
+    for (; len >= 255; len -= 255)
+        *op++ = 255;
+    *op++ = len;
+    return op;
+}
+
+
+/*! Write one sequence. `mlen` is 0 for the last sequence.
+ *  Return 0 if it doesn't fit in [op, end).
+ * */
+static uint8_t *put_seq(uint8_t *op, uint8_t *end, const uint8_t *lit,
+                        unsigned nlit, unsigned off, unsigned mlen) {
+    // token + literal length ext + literals + offset + match length ext
+    if ((size_t)(end - op) < 1 + nlit / 255 + 1 + nlit + 2 + mlen / 255 + 1)
+        return 0;
+
+    uint8_t *token = op++;
+    *token = (nlit < 15 ? nlit : 15) << 4;
+    if (nlit >= 15)
+        op = put_len(op, nlit - 15);
+    for (unsigned i = 0; i < nlit; ++i)
+        *op++ = lit[i];
+
+    if (mlen == 0)
+        return op;
+
+    *op++ = off & 0xff;
+    *op++ = off >> 8;
+    mlen -= MINMATCH;
+    *token |= mlen < 15 ? mlen : 15;
+    if (mlen >= 15)
+        op = put_len(op, mlen - 15);
+    return op;
+}
+
+
+/*! Compress `n` bytes of `src` into `dst`.
+ *  @ht      scratch hash table of LZ4_HTSIZE entries
+ *  @return  compressed size, 0 if it doesn't fit in `cap` bytes or
+ *           the input is too big.
+ * */
+int lz4_compress(const void *src, int n, void *dst, int cap, uint16_t *ht) {
+    const uint8_t *in     = src;
+    const uint8_t *anchor = in;
+    uint8_t       *op     = dst;
+    uint8_t       *end    = op + cap;
+
+    if (n < 0 || n > LZ4_MAXIN)
+        return 0;
+
+    for (int i = 0; i < LZ4_HTSIZE; ++i)
+        ht[i] = 0;
+
+    for (int ip = 0; ip + MFLIMIT <= n;) {
+        uint32_t v   = read32(in + ip);
+        unsigned h   = hash(v);
+        int      ref = ht[h];
+        ht[h]        = ip;
+
+        if (ref >= ip || read32(in + ref) != v) {
+            ip++;
+            continue;
+        }
+
+        int len = MINMATCH;
+        while (ip + len < n - LASTLITERALS && in[ref + len] == in[ip + len])
+            len++;
+
+        if ((op = put_seq(op, end, anchor, in + ip - anchor, ip - ref, len)) == 0)
+            return 0;
+        ip    += len;
+        anchor = in + ip;
+    }
+
+    if ((op = put_seq(op, end, anchor, in + n - anchor, 0, 0)) == 0)
+        return 0;
+    return op - (uint8_t *)dst;
+}
+
+
+/*! Read a length extension. Return -1 if it runs past `end`. */
+static int get_len(const uint8_t **ip, const uint8_t *end) {
+    int     len = 0;
+    uint8_t b;
+    do {
+        if (*ip >= end)
+            return -1;
+        b    = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return len;
+}
+
+
+/*! Decompress `n` bytes of `src` into `dst`. Every offset and length
+ *  is checked, a corrupted block never writes out of `dst`.
+ *  @return  decompressed size, -1 if the block is invalid or doesn't
+ *           fit in `cap` bytes.
+ * */
+int lz4_decompress(const void *src, int n, void *dst, int cap) {
+    const uint8_t *ip   = src;
+    const uint8_t *iend = ip + n;
+    uint8_t       *op   = dst;
+    uint8_t       *oend = op + cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        int      nlit  = token >> 4;
+        int      ext;
+
+        if (nlit == 15) {
+            if ((ext = get_len(&ip, iend)) < 0) return -1;
+            nlit += ext;
+        }
+        if (iend - ip < nlit || oend - op < nlit)
+            return -1;
+        for (int i = 0; i < nlit; ++i)
+            *op++ = *ip++;
+
+        if (ip == iend) // last sequence
+            break;
+
+        if (iend - ip < 2)
+            return -1;
+        unsigned off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (off == 0 || off > (unsigned)(op - (uint8_t *)dst))
+            return -1;
+
+        int mlen = token & 15;
+        if (mlen == 15) {
+            if ((ext = get_len(&ip, iend)) < 0) return -1;
+            mlen += ext;
+        }
+        mlen += MINMATCH;
+        if (oend - op < mlen)
+            return -1;
+
+        const uint8_t *ref = op - off;
+        for (int i = 0; i < mlen; ++i) // may overlap, copy forward
+            *op++ = *ref++;
+    }
+    return op - (uint8_t *)dst;
+}
@@ -0,0 +1,11 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+#define LZ4_HASHLOG 12
+#define LZ4_HTSIZE  (1 << LZ4_HASHLOG) // entries of the compressor hash table
+#define LZ4_MAXIN   0xffff             // max input size of one block
+
+
+int lz4_compress(const void *src, int n, void *dst, int cap, uint16_t *ht);
+int lz4_decompress(const void *src, int n, void *dst, int cap);
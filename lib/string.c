@@ -21,9 +21,9 @@ void *memmove(void *dest, const void *src, size_t n) {
     if (s < d && s + n > d) {
         s += n;
         d += n;
-        while (--n) *d-- = *s--;
+        while (n--) *--d = *--s;
     } else {
-        while (--n) *d++ = *s++;
+        while (n--) *d++ = *s++;
     }
     return dest;
 }
@@ -52,6 +52,13 @@ size_t strlen(const char *s) {
 }
 
 
+size_t strnlen(const char *s, size_t maxlen) {
+    size_t n = 0;
+    for (; n < maxlen && s[n]; n++);
+    return n;
+}
+
+
 int strncmp(const char *s1, const char *s2, size_t n) {
     while(n > 0 && *s1 == *s2) {
         n--; s1++; s2++;
@@ -113,18 +120,23 @@ char *strtok(char *str, const char *delim) {
 char *strtok_r(char *str, const char *delim, char **saveptr) {
     if (delim[0] == '\0') return 0;
 
-    int n;
     char *s, *e;
 
-    if (str == 0) s = e = *saveptr;
-    else          s = e = str + strspn(str, delim); // skip initial delim
+    if (str == 0) s = *saveptr;
+    else          s = str;
 
-    for (; *e && (n = strspn(e, delim)) == 0; ++e);
-    if (*e == '\0') return 0;
+    s += strspn(s, delim); // skip leading delim
+    if (*s == '\0') {
+        *saveptr = s;
+        return 0;
+    }
 
-    *e = '\0';
-    e += n;
-    *saveptr = e;
+    if ((e = strpbrk(s, delim)) != 0) {
+        *e = '\0';
+        *saveptr = e + 1;
+    } else {
+        *saveptr = s + strlen(s); // last token
+    }
     return s;
 }
 
@@ -7,6 +7,7 @@ void  *memmove(void *, const void *, size_t);
 void   memcpy(void *, const void *, size_t);
 void  *memset(void *, int, size_t);
 size_t strlen(const char *);
+size_t strnlen(const char *, size_t);
 int    strncmp(const char *, const char *, size_t);
 char  *strncpy(char *, const char *, size_t);
 char  *strrev(char *s);
@@ -1,5 +1,55 @@
 #pragma once
 
+/* file system usage, same layout as the kernel StatFs */
+typedef struct StatFs {
+    unsigned           bsize;   // block size
+    unsigned           blocks;  // number of data blocks
+    unsigned           bfree;   // number of free data blocks
+    unsigned           files;   // number of inodes
+    unsigned           ffree;   // number of free inodes
+    unsigned           zin;     // bytes given to the compressor
+    unsigned           zout;    // bytes it wrote, headers included
+    unsigned long long zcycles; // cpu cycles spent compressing
+    unsigned long long dcycles; // cpu cycles spent decompressing
+} StatFs;
+
+
+/* context switch counters, same layout as the kernel SchedStat */
+typedef struct SchedStat {
+    unsigned           nswitch; // number of process switches
+    unsigned long long cycles;  // cpu cycles spent switching
+} SchedStat;
+
+
+/* physical memory usage, same layout as the kernel MemStat */
+typedef struct MemStat {
+    unsigned pages;      // pages managed by the allocator
+    unsigned free;       // free pages
+    unsigned blocks[11]; // free blocks of 2^i pages
+    unsigned high;       // highmem pages
+    unsigned highfree;   // free highmem pages
+} MemStat;
+
+
+/* open flags */
+#define O_RDONLY 0x000
+#define O_WRONLY 0x001
+#define O_RDWR   0x002
+#define O_CREATE 0x200 // create an empty file if it doesn't exist
+
+
+/* ioctl commands */
+#define FIOCLONE   1 // ioctl(dst, FIOCLONE, src), share the blocks of src
+#define FIOSETCOMP 2 // ioctl(fd, FIOSETCOMP, 1), compress an empty file
+
+
+/* mmap protection and flags */
+#define PROT_READ   0x1
+#define PROT_WRITE  0x2
+#define MAP_SHARED  0x1 // writes reach the file
+#define MAP_PRIVATE 0x2 // writes go to a private copy of the page
+
+
 /* user system call interfaces */
 int   fork();
 int   exit() __attribute__((noreturn));
@@ -9,3 +59,19 @@ int   exec(char *, char **);
 int   getpid();
 char *sbrk(int);
 int   sleep(int);
+int   write(int, const void *, int);
+int   read(int, void *, int);
+int   getdents(int, char *, int);
+int   fsync(int);
+int   fdatasync(int);
+int   sync();
+int   statfs(StatFs *);
+int   ftruncate(int, int);
+int   unlink(char *);
+int   fallocate(int, int, int);
+int   ioctl(int, int, int);
+void *mmap(void *, int, int, int, int, int);
+int   munmap(void *, int);
+int   schedstat(SchedStat *);
+int   memstat(MemStat *);
+int   open(char *, int);
@@ -11,8 +11,24 @@ global %1
     ret
 %endmacro
 
-SYSCALL fork,   SYS_FORK
-SYSCALL exit,   SYS_EXIT
-SYSCALL exec,   SYS_EXEC
-SYSCALL getpid, SYS_GETPID
-SYSCALL sbrk,   SYS_SBRK
+SYSCALL fork,      SYS_FORK
+SYSCALL exit,      SYS_EXIT
+SYSCALL exec,      SYS_EXEC
+SYSCALL getpid,    SYS_GETPID
+SYSCALL sbrk,      SYS_SBRK
+SYSCALL write,     SYS_WRITE
+SYSCALL read,      SYS_READ
+SYSCALL getdents,  SYS_GETDENTS
+SYSCALL fsync,     SYS_FSYNC
+SYSCALL fdatasync, SYS_FDATASYNC
+SYSCALL sync,      SYS_SYNC
+SYSCALL statfs,    SYS_STATFS
+SYSCALL ftruncate, SYS_FTRUNCATE
+SYSCALL unlink,    SYS_UNLINK
+SYSCALL fallocate, SYS_FALLOCATE
+SYSCALL ioctl,     SYS_IOCTL
+SYSCALL mmap,      SYS_MMAP
+SYSCALL munmap,    SYS_MUNMAP
+SYSCALL schedstat, SYS_SCHEDSTAT
+SYSCALL memstat,   SYS_MEMSTAT
+SYSCALL open,      SYS_OPEN
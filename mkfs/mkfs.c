@@ -37,38 +37,77 @@ void rsec(off_t sec, char *buf) {
 }
 
 
+/* Layout: [ super | log header | log .. | inode .. | imap .. | bmap .. | refcnt .. | data .. ] */
+#define FSSIZE  MAXBLKS                                // total blocks
+#define NINODES 200                                    // number of inodes
+#define IPB     (BSIZE / sizeof(DInode))               // inodes per block
+#define BPB     (BSIZE * 8)                            // bitmap bits per block
+#define NINOBLK (NINODES / IPB + 1)                    // inode blocks
+#define NIMAP   (NINODES / BPB + 1)                    // inode bitmap blocks
+#define NMETA   (1 + 1 + NLOG + NINOBLK + NIMAP)       // blocks before bmap
+#define ROOTINO 1                                      // inode 0 is reserved
+
+
 int main(int argc, char *argv[]) {
-    char *img = argv[1];
-    fd = open(img, O_RDWR | O_CREAT, 00666);
-
-    SuperBlock sb = (SuperBlock) {
-        .nblocks   = 30,
-        .ninodes   = 5,
-        .ndata     = 20,
-        .bmapstart = 6,
-        .datastart = 7,
+    unsigned flags = 0;
+    int      i     = 1;
+    if (i < argc && strcmp(argv[i], "-l") == 0) { // log-structured allocation
+        flags |= SB_LFS;
+        i++;
+    }
+    if (i + 1 != argc) {
+        fprintf(stderr, "usage: %s [-l] fs.img\n", argv[0]);
+        exit(1);
+    }
+
+    char *img = argv[i];
+    if ((fd = open(img, O_RDWR | O_CREAT, 00666)) < 0) {
+        perror("open");
+        exit(1);
+    }
+
+    unsigned nbmap = (FSSIZE - NMETA) / BPB + 1;
+    unsigned nrefc = (FSSIZE - NMETA) / BSIZE + 1; // one byte per block
+    unsigned ndata = FSSIZE - NMETA - nbmap - nrefc;
+    SuperBlock sb  = (SuperBlock) {
+        .nblocks    = FSSIZE,
+        .ninodes    = NINODES,
+        .ndata      = ndata,
+        .nfree      = ndata,
+        .nifree     = NINODES - 2, // inode 0 and the root
+        .nlog       = NLOG,
+        .logstart   = 1,
+        .inodestart = 1 + 1 + NLOG,
+        .imapstart  = 1 + 1 + NLOG + NINOBLK,
+        .bmapstart  = NMETA,
+        .refstart   = NMETA + nbmap,
+        .datastart  = NMETA + nbmap + nrefc,
+        .flags      = flags,
     };
 
-    // sb
+    // zero everything, an empty log header has n = 0
     memset(buf, 0, sizeof(buf));
+    for (unsigned i = 0; i < sb.nblocks; ++i) {
+        wsec(i, buf);
+    }
+
+    // sb
     memcpy(buf, &sb, sizeof(SuperBlock));
     wsec(0, buf);
 
-    // inodes
+    // root directory, empty
+    DInode root = (DInode) {
+        .type  = F_DIR,
+        .nlink = 1,
+    };
     memset(buf, 0, sizeof(buf));
-    wsec(1, buf);
-    wsec(2, buf);
-    wsec(3, buf);
-    wsec(4, buf);
-    wsec(5, buf);
+    memcpy(&buf[(ROOTINO % IPB) * sizeof(DInode)], &root, sizeof(DInode));
+    wsec(sb.inodestart + ROOTINO / IPB, buf);
 
-    // bmap
-    wsec(6, buf);
-
-    // data
-    for (unsigned i = 8; i <= sb.nblocks; ++i) {
-        wsec(i, buf);
-    }
+    // imap, inode 0 and the root are used
+    memset(buf, 0, sizeof(buf));
+    buf[0] = 0x80 | (0x80 >> ROOTINO);
+    wsec(sb.imapstart, buf);
 
-    return 240;
+    return 0;
 }